@@ -0,0 +1,348 @@
+// Microbenchmarks of the cache engine and the per-request key and header work around it.
+//
+//   cache_bench --benchmark_out=results.json --benchmark_out_format=json
+//
+// Threaded benchmarks share one Cache, so they measure how the single cache mutex scales;
+// compare items_per_second across thread counts. Two runs can be compared with
+// compare.py from Google Benchmark's tools.
+
+#include <benchmark/benchmark.h>
+#include "Cache.hpp"
+#include "CacheControl.hpp"
+#include "KeyNormalizer.hpp"
+#include "Proxy.hpp"
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    constexpr int CAPACITY = 1 << 16;
+    constexpr int64_t LONG_TTL_MS = 60 * 60 * 1000;
+    constexpr size_t SEQUENCE = 1 << 14; // precomputed picks per thread
+
+    // Keys look like URLs that share a long prefix and differ at the end.
+    std::vector<std::string> MakeKeys(size_t count, size_t length, const std::string& tag) {
+        std::vector<std::string> keys;
+        keys.reserve(count);
+
+        for (size_t i = 0; i < count; i++) {
+            std::string suffix = "/" + tag + std::to_string(i);
+            std::string key = "/api/v1/items";
+            key.resize(std::max(length, key.size() + suffix.size()) - suffix.size(), 'x');
+            keys.push_back(key + suffix);
+        }
+
+        return keys;
+    }
+
+    std::shared_ptr<CacheSpace::CachedResponse> MakeResponse(size_t body_size, int64_t expires_at) {
+        auto response = std::make_shared<CacheSpace::CachedResponse>();
+        response->status = 200;
+        response->expires_at = expires_at;
+        response->headers = {{"Content-Type", "application/json"}, {"ETag", "\"abc\""}, {"Cache-Control", "max-age=60"}};
+        response->body.assign(body_size, 'x');
+        return response;
+    }
+
+    // Drains expired entries the way Proxy::TTLFunction does.
+    class Expirer {
+    public:
+        explicit Expirer(CacheSpace::Cache& cache) : cache(cache), thread([this] { Run(); }) {}
+
+        ~Expirer() {
+            running = false;
+            cache.ttl_cv.notify_all();
+            thread.join();
+        }
+
+    private:
+        void Run() {
+            while (running) {
+                {
+                    std::unique_lock<std::mutex> lock(cache.ttl_mtx);
+                    cache.ttl_cv.wait_for(lock, std::chrono::milliseconds(cache.MillisUntilNextExpiry()));
+                }
+
+                while (cache.CheckHeapTop()) {}
+            }
+        }
+
+        CacheSpace::Cache& cache;
+        std::atomic<bool> running{true};
+        std::thread thread;
+    };
+
+    // State shared by the threads of one run. Thread 0 sets it up before the timed loop and
+    // tears it down after; the loop boundaries are barriers.
+    struct Shared {
+        std::unique_ptr<CacheSpace::Cache> cache;
+        std::unique_ptr<Expirer> expirer;
+        std::vector<std::string> keys;
+        std::vector<std::string> absent;
+    };
+
+    Shared shared;
+
+    void TearDown(benchmark::State& state) {
+        if (state.thread_index() == 0) {
+            shared.expirer.reset();
+            shared.cache.reset();
+            shared.keys.clear();
+            shared.absent.clear();
+        }
+    }
+
+    // Args: hit percentage, key length.
+    void BM_Get(benchmark::State& state) {
+        int hit_percent = static_cast<int>(state.range(0));
+        size_t key_length = static_cast<size_t>(state.range(1));
+
+        if (state.thread_index() == 0) {
+            shared.cache = std::make_unique<CacheSpace::Cache>(CAPACITY, LONG_TTL_MS);
+            shared.keys = MakeKeys(CAPACITY, key_length, "k");
+            shared.absent = MakeKeys(CAPACITY, key_length, "a");
+            auto response = MakeResponse(1024, shared.cache->GetCurrentMillis() + LONG_TTL_MS);
+
+            for (const auto& key : shared.keys) {
+                shared.cache->put(key, response);
+            }
+        }
+
+        std::mt19937_64 rng(state.thread_index());
+        std::vector<std::pair<uint32_t, bool>> picks(SEQUENCE);
+
+        for (auto& [index, hit] : picks) {
+            index = std::uniform_int_distribution<uint32_t>(0, CAPACITY - 1)(rng);
+            hit = std::uniform_int_distribution<int>(0, 99)(rng) < hit_percent;
+        }
+
+        size_t i = 0;
+
+        for (auto _ : state) {
+            const auto& [index, hit] = picks[i++ % SEQUENCE];
+            benchmark::DoNotOptimize(shared.cache->get(hit ? shared.keys[index] : shared.absent[index]));
+        }
+
+        state.SetItemsProcessed(state.iterations());
+        TearDown(state);
+    }
+
+    // Args: body size, key length. Half of the puts evict, and entries expire after 10 ms so
+    // that the expiry heap, drained as in the proxy, stays bounded.
+    void BM_Put(benchmark::State& state) {
+        size_t body_size = static_cast<size_t>(state.range(0));
+        size_t key_length = static_cast<size_t>(state.range(1));
+        constexpr int64_t TTL_MS = 10;
+
+        if (state.thread_index() == 0) {
+            shared.cache = std::make_unique<CacheSpace::Cache>(CAPACITY / 2, TTL_MS);
+            shared.keys = MakeKeys(CAPACITY, key_length, "k");
+            shared.expirer = std::make_unique<Expirer>(*shared.cache);
+        }
+
+        std::mt19937_64 rng(state.thread_index());
+        std::vector<uint32_t> picks(SEQUENCE);
+
+        for (auto& index : picks) {
+            index = std::uniform_int_distribution<uint32_t>(0, CAPACITY - 1)(rng);
+        }
+
+        // The proxy builds each response before storing it, so the body copy is part of a put.
+        auto response = MakeResponse(body_size, 0);
+        size_t i = 0;
+
+        for (auto _ : state) {
+            response->expires_at = shared.cache->GetCurrentMillis() + TTL_MS;
+            shared.cache->put(shared.keys[picks[i++ % SEQUENCE]], *response);
+        }
+
+        state.SetItemsProcessed(state.iterations());
+        state.SetBytesProcessed(state.iterations() * body_size);
+        TearDown(state);
+    }
+
+    // Args: read percentage. Gets and puts over twice as many keys as fit, so gets hit about
+    // as often as the LRU keeps the key.
+    void BM_GetPut(benchmark::State& state) {
+        int read_percent = static_cast<int>(state.range(0));
+
+        if (state.thread_index() == 0) {
+            shared.cache = std::make_unique<CacheSpace::Cache>(CAPACITY, LONG_TTL_MS);
+            shared.keys = MakeKeys(CAPACITY * 2, 64, "k");
+            auto response = MakeResponse(1024, shared.cache->GetCurrentMillis() + LONG_TTL_MS);
+
+            // Starts full, as a cache that has been running for a while.
+            for (int i = 0; i < CAPACITY; i++) {
+                shared.cache->put(shared.keys[i * 2], response);
+            }
+        }
+
+        std::mt19937_64 rng(state.thread_index());
+        std::vector<std::pair<uint32_t, bool>> picks(SEQUENCE);
+
+        for (auto& [index, read] : picks) {
+            index = std::uniform_int_distribution<uint32_t>(0, CAPACITY * 2 - 1)(rng);
+            read = std::uniform_int_distribution<int>(0, 99)(rng) < read_percent;
+        }
+
+        auto response = MakeResponse(1024, CacheSpace::CoarseClock::NowMillis() + LONG_TTL_MS);
+        size_t i = 0;
+        int64_t hits = 0;
+        int64_t reads = 0;
+
+        for (auto _ : state) {
+            const auto& [index, read] = picks[i++ % SEQUENCE];
+
+            if (read) {
+                reads++;
+                hits += shared.cache->get(shared.keys[index]) != nullptr;
+            } else {
+                shared.cache->put(shared.keys[index], response);
+            }
+        }
+
+        state.SetItemsProcessed(state.iterations());
+        state.counters["hit_ratio"] = benchmark::Counter(reads ? static_cast<double>(hits) / reads : 0.0, benchmark::Counter::kAvgThreads);
+        TearDown(state);
+    }
+
+    // Arg: entries. Times CheckHeapTop removing that many expired entries.
+    void BM_CheckHeapTopDrain(benchmark::State& state) {
+        size_t entries = static_cast<size_t>(state.range(0));
+        auto keys = MakeKeys(entries, 64, "k");
+        std::unique_ptr<CacheSpace::Cache> cache;
+
+        for (auto _ : state) {
+            state.PauseTiming();
+            cache = std::make_unique<CacheSpace::Cache>(static_cast<int>(entries), 0);
+            auto response = MakeResponse(64, cache->GetCurrentMillis() - 1);
+
+            for (const auto& key : keys) {
+                cache->put(key, response);
+            }
+
+            state.ResumeTiming();
+
+            while (cache->CheckHeapTop()) {}
+        }
+
+        state.SetItemsProcessed(state.iterations() * entries);
+    }
+
+    // Args: variants per URL, whether Accept-Language is normalized. Looks up a variant the
+    // way Proxy::Respond does: one Find whose hasher reads the request's Vary headers.
+    void BM_FindVariant(benchmark::State& state) {
+        size_t variants = static_cast<size_t>(state.range(0));
+        bool normalize = state.range(1) != 0;
+        constexpr size_t URLS = 4096;
+        static const std::vector<std::string> LANGUAGES = {
+            "en-US,en;q=0.9", "de-DE,de;q=0.8,en;q=0.5", "fr-CH, fr;q=0.9, en;q=0.8", "es", "ja-JP,ja;q=0.9",
+            "pt-BR,pt;q=0.9", "it-IT,it;q=0.7", "nl", "sv-SE", "da, en-GB;q=0.8", "pl-PL", "ko-KR,ko;q=0.9",
+            "zh-CN,zh;q=0.9", "ru-RU,ru;q=0.9", "tr-TR", "cs-CZ,cs;q=0.9"
+        };
+
+        ProxySpace::RoutePolicy policy;
+
+        if (normalize) {
+            policy.vary_languages = {"en", "de", "fr", "es", "ja"};
+        }
+
+        CacheSpace::Cache cache(static_cast<int>(URLS * variants), LONG_TTL_MS);
+        auto urls = MakeKeys(URLS, 64, "u");
+        std::vector<std::string> vary = ProxySpace::Proxy::ParseVary("Accept-Language");
+        auto response = MakeResponse(1024, cache.GetCurrentMillis() + LONG_TTL_MS);
+        std::vector<httplib::Request> requests(variants);
+
+        for (size_t v = 0; v < variants; v++) {
+            requests[v].headers.insert({"Accept-Language", LANGUAGES[v % LANGUAGES.size()]});
+        }
+
+        for (const auto& url : urls) {
+            for (const auto& req : requests) {
+                cache.Store(url, vary, ProxySpace::Proxy::VariantHash(policy, req, vary), response);
+            }
+        }
+
+        size_t i = 0;
+
+        for (auto _ : state) {
+            const auto& req = requests[i % variants];
+            const auto& url = urls[i++ % URLS];
+            auto lookup = cache.Find(url, [&](const std::vector<std::string>& names) {
+                return ProxySpace::Proxy::VariantHash(policy, req, names);
+            });
+            benchmark::DoNotOptimize(lookup);
+        }
+
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    // Arg: 0 keys by the raw target, 1 sorts, decodes and filters the query as configured with
+    // "cache-key". This is all of Proxy::MakeCacheKey.
+    void BM_MakeCacheKey(benchmark::State& state) {
+        ProxySpace::KeyNormalizer normalizer;
+
+        if (state.range(0) != 0) {
+            normalizer = ProxySpace::KeyNormalizer(true, true, {"utm_*", "fbclid", "gclid"}, {});
+        }
+
+        const std::string target = "/search/results?q=caf%C3%A9+au+lait&utm_source=newsletter&page=2&utm_medium=email&sort=price&fbclid=IwAR3x";
+
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(normalizer.Normalize(target));
+        }
+
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void BM_ParseVary(benchmark::State& state) {
+        const std::string vary = "Accept-Encoding, Accept-Language, User-Agent";
+
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(ProxySpace::Proxy::ParseVary(vary));
+        }
+
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    // What replaced ParseMaxAge: every response's Cache-Control goes through here.
+    void BM_ParseCacheControl(benchmark::State& state) {
+        const std::string value = "public, max-age=3600, s-maxage=600, stale-while-revalidate=30, stale-if-error=86400";
+
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(ProxySpace::ParseCacheControl(value));
+        }
+
+        state.SetItemsProcessed(state.iterations());
+    }
+}
+
+BENCHMARK(BM_Get)
+    ->ArgsProduct({{0, 50, 90, 100}, {32, 256}})
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+BENCHMARK(BM_Put)
+    ->ArgsProduct({{256, 16 * 1024, 256 * 1024}, {32, 256}})
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+BENCHMARK(BM_GetPut)
+    ->Arg(50)->Arg(90)->Arg(99)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+BENCHMARK(BM_CheckHeapTopDrain)
+    ->RangeMultiplier(4)->Range(1 << 10, 1 << 16)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_FindVariant)
+    ->ArgsProduct({{1, 4, 16}, {0, 1}});
+
+BENCHMARK(BM_MakeCacheKey)->Arg(0)->Arg(1);
+BENCHMARK(BM_ParseVary);
+BENCHMARK(BM_ParseCacheControl);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,584 @@
+// Load generator for a running proxy. Every thread drives one keep-alive connection and the
+// report covers latency percentiles, throughput and the hit ratio seen in X-Cache.
+//
+//   proxy_bench --port 8100 --threads 8 --duration 30 --mode open --rate 20000
+//               --keys 100000 --dist zipf --zipf-s 0.99 --miss-ratio 0.05
+//               --sizes 1024:0.9,262144:0.1 --path "/bench/{key}?size={size}"
+//
+// Open loop sends on a fixed schedule and measures from when each request was due, so a stall
+// counts against every request queued behind it. Closed loop sends as fast as the responses
+// come back; its corrected percentiles backfill the requests a stall kept from being sent.
+
+#include "httplib.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    using SteadyClock = std::chrono::steady_clock;
+
+    enum class Mode { Open, Closed };
+    enum class Distribution { Zipf, Uniform, Scan };
+
+    struct SizeWeight {
+        size_t size;
+        double weight;
+    };
+
+    struct Options {
+        std::string host{"localhost"};
+        int port{8100};
+        int threads{4};
+        Mode mode{Mode::Closed};
+        double rate{1000.0}; // requests per second over all threads, open loop only
+        double duration_s{10.0};
+        double warmup_s{2.0}; // requests sent before this are not recorded
+        size_t keys{10000};
+        Distribution distribution{Distribution::Zipf};
+        double zipf_s{0.99};
+        double miss_ratio{0.0}; // share of requests for keys that are never requested again
+        std::vector<SizeWeight> sizes{{1024, 1.0}};
+        std::string path{"/bench/{key}?size={size}"};
+        httplib::Headers headers;
+        int64_t expected_interval_us{0}; // closed loop correction, 0 uses the mean latency
+        bool json{false};
+    };
+
+    // Microsecond latencies in log-linear buckets: every power of two is split into 32, so a
+    // reported percentile is within about 3% of the recorded value.
+    class LatencyHistogram {
+    public:
+        static constexpr int SUB_BUCKET_BITS = 5;
+        static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+        static constexpr int MAX_BITS = 40;
+        static constexpr int BUCKETS = (MAX_BITS - SUB_BUCKET_BITS) * SUB_BUCKETS + SUB_BUCKETS;
+
+        void Record(int64_t value, uint64_t count = 1) {
+            value = std::clamp<int64_t>(value, 0, (int64_t{1} << MAX_BITS) - 1);
+            counts[BucketIndex(value)] += count;
+            total += count;
+            sum += static_cast<double>(value) * count;
+            max = std::max(max, value);
+        }
+
+        // What a caller who sends every expected_interval would have seen: a response that took
+        // n intervals also held up the n - 1 requests that should have been sent meanwhile.
+        void RecordCorrected(int64_t value, int64_t expected_interval, uint64_t count = 1) {
+            Record(value, count);
+
+            if (expected_interval <= 0) {
+                return;
+            }
+
+            for (int64_t missing = value - expected_interval; missing >= expected_interval; missing -= expected_interval) {
+                Record(missing, count);
+            }
+        }
+
+        LatencyHistogram Corrected(int64_t expected_interval) const {
+            LatencyHistogram corrected;
+
+            for (int i = 0; i < BUCKETS; i++) {
+                if (counts[i] > 0) {
+                    corrected.RecordCorrected(std::min(BucketUpperBound(i), max), expected_interval, counts[i]);
+                }
+            }
+
+            return corrected;
+        }
+
+        void Merge(const LatencyHistogram& other) {
+            for (int i = 0; i < BUCKETS; i++) {
+                counts[i] += other.counts[i];
+            }
+
+            total += other.total;
+            sum += other.sum;
+            max = std::max(max, other.max);
+        }
+
+        int64_t Percentile(double percentile) const {
+            if (total == 0) {
+                return 0;
+            }
+
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * total)));
+            uint64_t seen = 0;
+
+            for (int i = 0; i < BUCKETS; i++) {
+                seen += counts[i];
+
+                if (seen >= rank) {
+                    return std::min(BucketUpperBound(i), max);
+                }
+            }
+
+            return max;
+        }
+
+        uint64_t Count() const { return total; }
+        double Mean() const { return total == 0 ? 0.0 : sum / total; }
+        int64_t Max() const { return max; }
+
+    private:
+        // Values below 2 * SUB_BUCKETS have a bucket each; above, bucket width doubles with
+        // every power of two.
+        static int BucketIndex(int64_t value) {
+            if (value < 2 * SUB_BUCKETS) {
+                return static_cast<int>(value);
+            }
+
+            int shift = std::bit_width(static_cast<uint64_t>(value)) - SUB_BUCKET_BITS - 1;
+            return shift * SUB_BUCKETS + static_cast<int>(value >> shift);
+        }
+
+        static int64_t BucketUpperBound(int index) {
+            if (index < 2 * SUB_BUCKETS) {
+                return index;
+            }
+
+            int shift = index / SUB_BUCKETS - 1;
+            int64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+            return ((mantissa + 1) << shift) - 1;
+        }
+
+        std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+        uint64_t total{0};
+        double sum{0.0};
+        int64_t max{0};
+    };
+
+    uint64_t SplitMix64(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // Picks keys and turns them into request targets. Sizes are a function of the key, so the
+    // origin is asked for the same object every time a key comes up.
+    class Workload {
+    public:
+        Workload(const Options& options) : options(options) {
+            if (options.distribution == Distribution::Zipf) {
+                zipf_cdf.resize(options.keys);
+                double total = 0.0;
+
+                for (size_t rank = 0; rank < options.keys; rank++) {
+                    total += 1.0 / std::pow(static_cast<double>(rank + 1), options.zipf_s);
+                    zipf_cdf[rank] = total;
+                }
+
+                for (double& p : zipf_cdf) {
+                    p /= total;
+                }
+            }
+
+            double total = 0.0;
+
+            for (const auto& size : options.sizes) {
+                total += size.weight;
+                size_cdf.push_back(total);
+            }
+
+            for (double& p : size_cdf) {
+                p /= total;
+            }
+
+            run_id = std::random_device{}();
+        }
+
+        // Per-thread state: the random engine and the scan position.
+        struct Cursor {
+            std::mt19937_64 rng;
+            size_t scan{0};
+            uint64_t unique{0};
+        };
+
+        Cursor MakeCursor(int thread) const {
+            return {std::mt19937_64(SplitMix64(run_id + thread)), options.keys * thread / options.threads, 0};
+        }
+
+        std::string NextTarget(Cursor& cursor, int thread) const {
+            std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+            if (options.miss_ratio > 0.0 && unit(cursor.rng) < options.miss_ratio) {
+                uint64_t id = cursor.unique++;
+                std::string key = "miss-" + std::to_string(run_id) + "-" + std::to_string(thread) + "-" + std::to_string(id);
+                return Target(key, SizeFor(SplitMix64(run_id ^ (static_cast<uint64_t>(thread) << 40) ^ id)));
+            }
+
+            size_t key = 0;
+
+            switch (options.distribution) {
+                case Distribution::Zipf:
+                    key = std::lower_bound(zipf_cdf.begin(), zipf_cdf.end(), unit(cursor.rng)) - zipf_cdf.begin();
+                    key = std::min(key, options.keys - 1);
+                    break;
+                case Distribution::Uniform:
+                    key = std::uniform_int_distribution<size_t>(0, options.keys - 1)(cursor.rng);
+                    break;
+                case Distribution::Scan:
+                    key = cursor.scan++ % options.keys;
+                    break;
+            }
+
+            return Target(std::to_string(key), SizeFor(SplitMix64(key)));
+        }
+
+    private:
+        size_t SizeFor(uint64_t hash) const {
+            double p = static_cast<double>(hash >> 11) / static_cast<double>(uint64_t{1} << 53);
+            size_t index = std::lower_bound(size_cdf.begin(), size_cdf.end(), p) - size_cdf.begin();
+            return options.sizes[std::min(index, options.sizes.size() - 1)].size;
+        }
+
+        std::string Target(const std::string& key, size_t size) const {
+            std::string target = options.path;
+            Replace(target, "{key}", key);
+            Replace(target, "{size}", std::to_string(size));
+            return target;
+        }
+
+        static void Replace(std::string& text, const std::string& from, const std::string& to) {
+            for (size_t pos = text.find(from); pos != std::string::npos; pos = text.find(from, pos + to.size())) {
+                text.replace(pos, from.size(), to);
+            }
+        }
+
+        const Options& options;
+        std::vector<double> zipf_cdf;
+        std::vector<double> size_cdf;
+        uint64_t run_id;
+    };
+
+    struct ThreadResult {
+        LatencyHistogram response; // from when the request was due (open loop) or sent (closed)
+        LatencyHistogram service; // from when the request was sent
+        uint64_t hits{0};
+        uint64_t misses{0};
+        uint64_t uncached{0}; // no X-Cache header, e.g. errors the proxy answered itself
+        uint64_t failed{0}; // no response at all
+        uint64_t non_2xx{0};
+        uint64_t bytes{0};
+        uint64_t late{0}; // open loop requests sent after their due time
+        uint64_t unsent{0}; // open loop requests still not sent when the run ended
+    };
+
+    void RunThread(const Options& options, const Workload& workload, int thread, SteadyClock::time_point start, ThreadResult& result) {
+        httplib::Client client(options.host, options.port);
+        client.set_keep_alive(true);
+        client.set_tcp_nodelay(true);
+        client.set_connection_timeout(5, 0);
+        client.set_read_timeout(30, 0);
+
+        auto cursor = workload.MakeCursor(thread);
+        auto record_from = start + std::chrono::duration_cast<SteadyClock::duration>(std::chrono::duration<double>(options.warmup_s));
+        auto stop = record_from + std::chrono::duration_cast<SteadyClock::duration>(std::chrono::duration<double>(options.duration_s));
+
+        // Each thread takes every threads-th slot of the overall schedule.
+        auto interval = std::chrono::duration_cast<SteadyClock::duration>(std::chrono::duration<double>(options.threads / options.rate));
+        auto due = start + interval * thread / options.threads;
+
+        while (true) {
+            if (options.mode == Mode::Open) {
+                if (due >= stop) {
+                    break;
+                }
+
+                auto now = SteadyClock::now();
+
+                // A connection that cannot keep up stops at the end of the run and reports the
+                // backlog, instead of working through it.
+                if (now >= stop) {
+                    result.unsent += (stop - due) / interval + 1;
+                    break;
+                }
+
+                // A backlog left over from the warmup is dropped, or it would be all we measure.
+                if (due < record_from && now >= record_from) {
+                    due += ((record_from - due) / interval + 1) * interval;
+                }
+
+                if (now < due) {
+                    std::this_thread::sleep_until(due);
+                } else if (now - due > interval) {
+                    result.late++;
+                }
+            } else {
+                due = SteadyClock::now();
+
+                if (due >= stop) {
+                    break;
+                }
+            }
+
+            std::string target = workload.NextTarget(cursor, thread);
+            auto sent = SteadyClock::now();
+            std::string cache_status;
+            int status = 0;
+            uint64_t bytes = 0;
+
+            auto response = client.Get(target, options.headers,
+                [&](const httplib::Response& res) {
+                    status = res.status;
+                    cache_status = res.get_header_value("X-Cache");
+                    return true;
+                },
+                [&](const char*, size_t length) {
+                    bytes += length;
+                    return true;
+                }
+            );
+
+            auto done = SteadyClock::now();
+            bool recorded = due >= record_from;
+
+            if (recorded) {
+                result.response.Record(std::chrono::duration_cast<std::chrono::microseconds>(done - due).count());
+                result.service.Record(std::chrono::duration_cast<std::chrono::microseconds>(done - sent).count());
+
+                if (!response) {
+                    result.failed++;
+                } else {
+                    result.bytes += bytes;
+                    result.non_2xx += status < 200 || status >= 300;
+
+                    if (cache_status == "HIT") {
+                        result.hits++;
+                    } else if (cache_status == "MISS") {
+                        result.misses++;
+                    } else {
+                        result.uncached++;
+                    }
+                }
+            }
+
+            due += interval;
+        }
+    }
+
+    std::vector<SizeWeight> ParseSizes(const std::string& value) {
+        std::vector<SizeWeight> sizes;
+        size_t start = 0;
+
+        while (start <= value.size()) {
+            size_t end = value.find(',', start);
+            std::string item = value.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            size_t colon = item.find(':');
+            sizes.push_back({std::stoull(item.substr(0, colon)), colon == std::string::npos ? 1.0 : std::stod(item.substr(colon + 1))});
+
+            if (end == std::string::npos) {
+                break;
+            }
+
+            start = end + 1;
+        }
+
+        return sizes;
+    }
+
+    Options ParseOptions(int argc, char** argv) {
+        Options options;
+
+        for (int i = 1; i < argc; i++) {
+            std::string name = argv[i];
+
+            if (name == "--json") {
+                options.json = true;
+                continue;
+            }
+
+            if (i + 1 >= argc) {
+                throw std::runtime_error("Missing value for " + name + "!");
+            }
+
+            std::string value = argv[++i];
+
+            if (name == "--host") {
+                options.host = value;
+            } else if (name == "--port") {
+                options.port = std::stoi(value);
+            } else if (name == "--threads") {
+                options.threads = std::stoi(value);
+            } else if (name == "--mode") {
+                if (value != "open" && value != "closed") {
+                    throw std::runtime_error("--mode must be \"open\" or \"closed\"!");
+                }
+
+                options.mode = value == "open" ? Mode::Open : Mode::Closed;
+            } else if (name == "--rate") {
+                options.rate = std::stod(value);
+            } else if (name == "--duration") {
+                options.duration_s = std::stod(value);
+            } else if (name == "--warmup") {
+                options.warmup_s = std::stod(value);
+            } else if (name == "--keys") {
+                options.keys = std::stoull(value);
+            } else if (name == "--dist") {
+                if (value == "zipf") {
+                    options.distribution = Distribution::Zipf;
+                } else if (value == "uniform") {
+                    options.distribution = Distribution::Uniform;
+                } else if (value == "scan") {
+                    options.distribution = Distribution::Scan;
+                } else {
+                    throw std::runtime_error("--dist must be zipf, uniform or scan!");
+                }
+            } else if (name == "--zipf-s") {
+                options.zipf_s = std::stod(value);
+            } else if (name == "--miss-ratio") {
+                options.miss_ratio = std::stod(value);
+            } else if (name == "--sizes") {
+                options.sizes = ParseSizes(value);
+            } else if (name == "--path") {
+                options.path = value;
+            } else if (name == "--header") {
+                size_t colon = value.find(':');
+
+                if (colon == std::string::npos) {
+                    throw std::runtime_error("--header must look like \"Name: value\"!");
+                }
+
+                size_t start = value.find_first_not_of(' ', colon + 1);
+                options.headers.insert({value.substr(0, colon), start == std::string::npos ? "" : value.substr(start)});
+            } else if (name == "--expected-interval-us") {
+                options.expected_interval_us = std::stoll(value);
+            } else {
+                throw std::runtime_error("Unknown option " + name + "!");
+            }
+        }
+
+        if (options.threads <= 0 || options.keys == 0 || options.rate <= 0.0 || options.duration_s <= 0.0) {
+            throw std::runtime_error("--threads, --keys, --rate and --duration must be positive!");
+        }
+
+        if (options.miss_ratio < 0.0 || options.miss_ratio > 1.0) {
+            throw std::runtime_error("--miss-ratio must be between 0 and 1!");
+        }
+
+        return options;
+    }
+
+    nlohmann::ordered_json Percentiles(const LatencyHistogram& histogram) {
+        nlohmann::ordered_json j;
+        j["count"] = histogram.Count();
+        j["mean_us"] = histogram.Mean();
+        j["p50_us"] = histogram.Percentile(50.0);
+        j["p99_us"] = histogram.Percentile(99.0);
+        j["p999_us"] = histogram.Percentile(99.9);
+        j["max_us"] = histogram.Max();
+        return j;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+
+    try {
+        options = ParseOptions(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+
+    Workload workload(options);
+    std::vector<ThreadResult> results(options.threads);
+    std::vector<std::thread> threads;
+
+    // Give every thread time to start before the schedule begins.
+    auto start = SteadyClock::now() + std::chrono::milliseconds(100);
+
+    for (int i = 0; i < options.threads; i++) {
+        threads.emplace_back(RunThread, std::cref(options), std::cref(workload), i, start, std::ref(results[i]));
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    ThreadResult total;
+
+    for (const auto& result : results) {
+        total.response.Merge(result.response);
+        total.service.Merge(result.service);
+        total.hits += result.hits;
+        total.misses += result.misses;
+        total.uncached += result.uncached;
+        total.failed += result.failed;
+        total.non_2xx += result.non_2xx;
+        total.bytes += result.bytes;
+        total.late += result.late;
+        total.unsent += result.unsent;
+    }
+
+    // Open loop latencies already count from the due time. Closed loop ones are backfilled
+    // as if each connection had meant to send once per expected interval.
+    LatencyHistogram corrected = total.response;
+
+    if (options.mode == Mode::Closed) {
+        int64_t expected = options.expected_interval_us > 0 ? options.expected_interval_us : std::llround(total.service.Mean());
+        corrected = total.service.Corrected(expected);
+    }
+
+    uint64_t completed = total.service.Count();
+    double throughput = completed / options.duration_s;
+    double hit_ratio = total.hits + total.misses == 0 ? 0.0 : static_cast<double>(total.hits) / (total.hits + total.misses);
+
+    if (options.json) {
+        nlohmann::ordered_json j;
+        j["mode"] = options.mode == Mode::Open ? "open" : "closed";
+        j["threads"] = options.threads;
+        j["duration_s"] = options.duration_s;
+
+        if (options.mode == Mode::Open) {
+            j["target_rate"] = options.rate;
+            j["late"] = total.late;
+            j["unsent"] = total.unsent;
+        }
+
+        j["requests"] = completed;
+        j["throughput_rps"] = throughput;
+        j["throughput_mbps"] = total.bytes / options.duration_s / 1e6;
+        j["hits"] = total.hits;
+        j["misses"] = total.misses;
+        j["uncached"] = total.uncached;
+        j["hit_ratio"] = hit_ratio;
+        j["failed"] = total.failed;
+        j["non_2xx"] = total.non_2xx;
+        j["latency"] = Percentiles(corrected);
+        j["service_time"] = Percentiles(total.service);
+        std::cout << j.dump(4) << "\n";
+
+        return 0;
+    }
+
+    auto print = [](const char* name, const LatencyHistogram& histogram) {
+        std::cout << name << ": p50 " << histogram.Percentile(50.0) << "us, p99 " << histogram.Percentile(99.0)
+            << "us, p99.9 " << histogram.Percentile(99.9) << "us, max " << histogram.Max()
+            << "us, mean " << std::llround(histogram.Mean()) << "us\n";
+    };
+
+    std::cout << "Requests: " << completed << " in " << options.duration_s << "s, " << std::llround(throughput) << " req/s, "
+        << total.bytes / options.duration_s / 1e6 << " MB/s\n";
+
+    if (options.mode == Mode::Open) {
+        std::cout << "Target rate: " << options.rate << " req/s, sent late: " << total.late << "\n";
+    }
+
+    std::cout << "Hits: " << total.hits << ", Misses: " << total.misses << ", Hit ratio: " << hit_ratio
+        << ", Uncached: " << total.uncached << ", Failed: " << total.failed << ", Non-2xx: " << total.non_2xx << "\n";
+    print("Latency (corrected)", corrected);
+    print("Service time", total.service);
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef ACCESS_LOG_HPP
+#define ACCESS_LOG_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace ProxySpace {
+    // COALESCED is reserved for requests that wait on another request's origin fetch.
+    enum class CacheOutcome : uint8_t { Hit, Miss, Revalidated, Stale, Coalesced };
+
+    std::string_view OutcomeName(CacheOutcome);
+
+    // One line of the access log. Timings are in microseconds; origin timings are 0 when the
+    // origin was not contacted.
+    struct AccessRecord {
+        int64_t timestamp_ms{0}; // wall clock, when the request arrived
+        int port{0};
+        std::string route; // the prefix of the route that served the request
+        uint64_t key_hash{0};
+        CacheOutcome outcome{CacheOutcome::Miss};
+        int status{0};
+        size_t bytes{0};
+        int64_t key_build_us{0};
+        int64_t cache_lookup_us{0};
+        int64_t origin_connect_us{0}; // TCP connect and TLS handshake
+        int64_t origin_ttfb_us{0}; // request sent until the response headers arrived
+        int64_t total_us{0};
+    };
+
+    // Writes AccessRecords as JSON lines. Requests only append to a batch under a short lock;
+    // a background thread formats and writes whole batches, and renames the file to path.1,
+    // path.2, ... once it reaches max_size bytes. When the writer falls MAX_PENDING records
+    // behind, further records are dropped and counted rather than held in memory.
+    class AccessLog {
+    public:
+        AccessLog(std::string path, size_t max_size, int max_files);
+        ~AccessLog();
+
+        void Write(AccessRecord);
+        uint64_t Dropped() const { return dropped.load(std::memory_order_relaxed); }
+
+    private:
+        static constexpr size_t BATCH_SIZE = 256; // records that wake the writer early
+        static constexpr size_t MAX_PENDING = 64 * 1024;
+        static constexpr int64_t FLUSH_INTERVAL_MS = 100;
+
+        void WriterFunction();
+        void Rotate();
+
+        std::string path;
+        size_t max_size;
+        int max_files;
+        size_t file_size{0};
+        std::ofstream file;
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::vector<AccessRecord> pending;
+        std::atomic<uint64_t> dropped{0};
+        bool is_running{true};
+        std::thread writer;
+    };
+}
+
+#endif
@@ -9,29 +9,122 @@
 #include <condition_variable>
 #include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <array>
 #include "httplib.h"
+#include "Clock.hpp"
+#include "MissRatioEstimator.hpp"
+#include "UrlStats.hpp"
 
 namespace CacheSpace {
     struct CachedResponse
     {
         int status;
-        int64_t expires_at;
+        int64_t expires_at; // monotonic milliseconds, see CoarseClock
         httplib::Headers headers;
         std::string body;
+        int64_t fetch_latency_ms{0}; // how long the origin took, weights early refreshes
+        uint64_t content_hash{0}; // see ContentHash, unset for segmented objects
+        std::string origin_etag; // the origin's ETag for the encoding it sent, which revalidation asks about
+        bool compressed_in_cache{false}; // gzipped here, so the origin sent it as identity
+
+        // How long past expires_at the entry may still be served: while it is refreshed in the
+        // background, or when the origin fails (RFC 5861). Both are 0 under must-revalidate.
+        int64_t stale_while_revalidate_ms{0};
+        int64_t stale_if_error_ms{0};
+        bool immutable{false}; // never refreshed early, see ShouldRefreshEarly
+
+        // Set on the entry of an object too large for one body. Its bytes live in separate
+        // entries of segment_size bytes each, keyed by SegmentKey, and the body stays empty.
+        size_t object_size{0};
+        size_t segment_size{0};
+        int64_t generation{0}; // see Cache::NextGeneration; entries derived from this one (segments, decompressed copies) carry it too
+
+        // Cache::Renew may move expires_at while the entry is being served, so readers that do
+        // not hold the cache lock go through here.
+        int64_t ExpiresAt() const {
+            return std::atomic_ref<int64_t>(const_cast<int64_t&>(expires_at)).load(std::memory_order_relaxed);
+        }
+
+        // The entry stays in the cache until the last stale window closes.
+        int64_t EvictAt(int64_t expires) const {
+            return expires + std::max(stale_while_revalidate_ms, stale_if_error_ms);
+        }
+
+        bool IsSegmented() const { return segment_size > 0; }
+        size_t ContentLength() const { return IsSegmented() ? object_size : body.size(); }
+    };
+
+    // Keys derived from a URL are set apart from it by a '\0', which no request target may
+    // contain (the proxy rejects those), so they cannot collide with the key of another URL.
+    inline std::string SegmentKey(const std::string& key, int64_t generation, size_t index) {
+        return key + '\0' + "segment:" + std::to_string(generation) + ":" + std::to_string(index);
+    }
+
+    // Variant 0 is the response of a URL that does not vary, which is stored under the URL itself.
+    inline std::string VariantKey(const std::string& url, uint64_t variant) {
+        if (variant == 0) {
+            return url;
+        }
+
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(variant));
+        return url + '\0' + "variant:" + hex;
+    }
+
+    // Hashes the request's values of the given Vary header names; see Cache::Find.
+    using VariantHasher = std::function<uint64_t(const std::vector<std::string>&)>;
+
+    struct Primary;
+
+    struct CacheEntry {
+        std::string key;
+        std::shared_ptr<CachedResponse> response;
+        std::pair<const std::string, Primary>* primary{nullptr}; // set on responses stored by URL
+    };
+
+    // Everything stored for one URL: the header names its responses vary on, and one entry per
+    // combination of their values seen so far. It goes away with its last variant.
+    struct Primary {
+        std::vector<std::string> vary;
+        std::vector<std::pair<uint64_t, std::list<CacheEntry>::iterator>> variants;
     };
 
-    using CACHE_PAIR = std::pair<std::string, std::shared_ptr<CachedResponse>>;
-    using PQ_PAIR = std::pair<std::string, int64_t>; // url, expire time
-    using HITS_AND_MISSES_PAIR = std::pair<long long, long long>;
+    struct Lookup {
+        std::string key;
+        std::shared_ptr<CachedResponse> response;
+    };
+
+    enum class EvictionReason { Capacity, Expired, Superseded, Cleared };
+    constexpr size_t EVICTION_REASONS = 4;
+
+    using PQ_PAIR = std::pair<std::string, int64_t>; // url, eviction time
+
+    // Where a cache reads the time. Simulations replace it to replay traces in virtual time.
+    using ClockFunction = int64_t (*)();
 
     class Cache {
     public:
-        Cache(int capacity, int ttl_seconds) : capacity(capacity), ttl_seconds(ttl_seconds) {}
+        Cache(int capacity, int64_t ttl_ms, ClockFunction clock = &CoarseClock::NowMillis)
+            : capacity(capacity), ttl_ms(ttl_ms), clock(clock), estimator(capacity) {}
 
         std::shared_ptr<CachedResponse> get(const std::string &);
+        Lookup Find(const std::string &, const VariantHasher &);
         void put(const std::string &, const CachedResponse &);
+        void put(const std::string &, std::shared_ptr<CachedResponse>);
+        std::string Store(const std::string &, const std::vector<std::string> &, uint64_t, std::shared_ptr<CachedResponse>);
+        bool Renew(const std::string &, int64_t, int64_t);
 
-        void IncrementURLHitsOrMisses(const std::string&, bool);
+        // A new CachedResponse::generation for each version stored; unlike the clock, never the
+        // same for two versions of a URL stored within a millisecond.
+        int64_t NextGeneration() { return generations.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+        void IncrementURLHitsOrMisses(const std::string& key, bool is_hit) {
+            url_stats.Record(key, is_hit);
+        }
         void IncrementHits(const std::string& key) { 
             hits.fetch_add(1, std::memory_order_relaxed); 
             IncrementURLHitsOrMisses(key, true);
@@ -47,22 +140,38 @@ namespace CacheSpace {
         int64_t GetMisses() const { return misses.load(std::memory_order_relaxed); }
         int64_t GetCompliantMisses() const { return compliant_misses.load(std::memory_order_relaxed); }
 
-        const std::unordered_map<std::string, CacheSpace::HITS_AND_MISSES_PAIR> GetURLHitsAndMisses() const {
-            std::shared_lock lock(mtx);
-            return url_hits_and_misses;
+        std::vector<UrlCounts> GetURLHitsAndMisses(const UrlStatsQuery& query) const {
+            return url_stats.Query(query);
         }
+        bool HasURLStats() const { return !url_stats.Empty(); }
         void clear();
-        int64_t GetCurrentSeconds();
+        int64_t GetCurrentMillis() const { return clock(); }
+
+        // Readable without the cache lock, for metrics.
+        int64_t Size() const { return entry_count.load(std::memory_order_relaxed); }
+        int64_t Bytes() const { return stored_bytes.load(std::memory_order_relaxed); }
+        uint64_t Evictions(EvictionReason reason) const {
+            return evictions[static_cast<size_t>(reason)].load(std::memory_order_relaxed);
+        }
+        // Capacity in entries. Shrinking evicts the least recently used entries right away.
+        int GetCapacity() const;
+        void SetCapacity(int);
+
+        // Hit ratios estimated for fractions and multiples of the capacity; see MissRatioEstimator.
+        MissRatioEstimator::Curve EstimateHitRatios() const;
+
+        int64_t MillisUntilNextExpiry() const;
         std::condition_variable ttl_cv;
         std::mutex ttl_mtx;
         bool CheckHeapTop();
         void LogEvent(const std::string&, bool);
-        std::string GetVarySpec(const std::string&) const;
-        void SetVarySpec(const std::string&, const std::string&);
 
         friend std::ostream& operator<<(std::ostream& os, const Cache& cache);
 
     private:
+        std::list<CacheEntry>::iterator Insert(const std::string &, std::shared_ptr<CachedResponse>);
+        void Erase(std::list<CacheEntry>::iterator, EvictionReason);
+
         struct ComparePQPairs {
             bool operator()(const PQ_PAIR& a, const PQ_PAIR& b) const {
                 // We want the earliest expire times on the top of the min heap.
@@ -70,17 +179,23 @@ namespace CacheSpace {
             }
         };
         
-        std::list<CACHE_PAIR> cache_list; 
-        std::unordered_map<std::string, std::list<CacheSpace::CACHE_PAIR>::iterator> cache_map;
-        std::unordered_map<std::string, CacheSpace::HITS_AND_MISSES_PAIR> url_hits_and_misses; 
+        std::list<CacheEntry> cache_list; 
+        std::unordered_map<std::string, std::list<CacheSpace::CacheEntry>::iterator> cache_map;
+        std::unordered_map<std::string, Primary> primaries;
+        UrlStats url_stats; // not guarded by mtx
         std::priority_queue<PQ_PAIR, std::vector<PQ_PAIR>, ComparePQPairs> min_heap;
         mutable std::shared_mutex mtx;
         std::atomic<int64_t> hits{0};
         std::atomic<int64_t> misses{0};
         std::atomic<int64_t> compliant_misses{0};
+        std::atomic<int64_t> entry_count{0};
+        std::atomic<int64_t> stored_bytes{0}; // bodies only
+        std::atomic<int64_t> generations{0};
+        std::array<std::atomic<uint64_t>, EVICTION_REASONS> evictions{};
         int capacity;
-        int ttl_seconds;
-        std::unordered_map<std::string, std::string> vary_specs;
+        int64_t ttl_ms;
+        ClockFunction clock;
+        MissRatioEstimator estimator; // fed by Find, the lookup of every proxied request
     };
 
     // Declared outside of the class.
@@ -90,7 +205,7 @@ namespace CacheSpace {
         << ", Misses: " << cache.misses << "\n"
         << ", Compliant Misses: " << cache.compliant_misses << "\n"
         << "Capacity: " << cache.capacity << "\n"
-        << "TTL Seconds: " << cache.ttl_seconds << "\n"
+        << "TTL Millis: " << cache.ttl_ms << "\n"
         << "Size of cache: " << cache.cache_list.size() << "\n";
 
         return os;
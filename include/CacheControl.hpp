@@ -0,0 +1,37 @@
+#ifndef CACHE_CONTROL_HPP
+#define CACHE_CONTROL_HPP
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace ProxySpace {
+    // The response directives of RFC 9111 section 5.2.2 (plus RFC 5861 and RFC 8246) that matter
+    // to a shared cache. Durations are in seconds.
+    struct CacheControl {
+        std::optional<int64_t> max_age;
+        std::optional<int64_t> s_maxage;
+        std::optional<int64_t> stale_while_revalidate;
+        std::optional<int64_t> stale_if_error;
+        bool no_store{false};
+        bool no_cache{false};
+        bool is_private{false};
+        bool is_public{false};
+        bool must_revalidate{false};
+        bool proxy_revalidate{false};
+        bool immutable{false};
+
+        // s-maxage overrides max-age for shared caches such as this one.
+        std::optional<int64_t> SharedMaxAge() const { return s_maxage ? s_maxage : max_age; }
+
+        // Once stale, the entry must not be served without a successful revalidation. no-cache
+        // entries are stored already stale, so it rules out serving them unvalidated at all.
+        bool MustRevalidate() const { return no_cache || must_revalidate || proxy_revalidate || s_maxage.has_value(); }
+    };
+
+    // Single pass over the header value, without allocating. Unknown directives are ignored,
+    // and when a directive repeats, the first occurrence wins.
+    CacheControl ParseCacheControl(std::string_view);
+}
+
+#endif 
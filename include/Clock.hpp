@@ -0,0 +1,36 @@
+#ifndef CLOCK_HPP
+#define CLOCK_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+namespace CacheSpace {
+    // A monotonic millisecond clock that is read from an atomic instead of calling into the OS.
+    // A single background ticker keeps it current, so the value can lag by up to one tick.
+    class CoarseClock {
+    public:
+        static int64_t NowMillis() {
+            return Instance().now_ms.load(std::memory_order_relaxed);
+        }
+
+        // Reads the underlying steady clock directly, for when a tick of lag is too much.
+        static int64_t PreciseMillis();
+
+    private:
+        // Freshness and TTLs are tolerant of a few milliseconds of lag, and an idle process should
+        // not be woken a thousand times a second to keep the clock current.
+        static constexpr int64_t TICK_MS = 10;
+
+        CoarseClock();
+        ~CoarseClock();
+        static CoarseClock& Instance();
+        void TickerFunction();
+
+        std::atomic<int64_t> now_ms{0};
+        std::atomic<bool> is_running{true};
+        std::thread ticker;
+    };
+};
+
+#endif 
@@ -0,0 +1,27 @@
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include "httplib.h"
+
+namespace CacheSpace {
+    // gzip (RFC 1952) helpers built on zlib.
+    std::optional<std::string> GzipCompress(std::string_view, int level = 6);
+    std::optional<std::string> GzipDecompress(std::string_view, size_t max_size);
+
+    // Text-like types compress well; images, video and archives are already compressed.
+    bool IsCompressibleType(std::string_view);
+
+    // The ETag of another content coding of the response an ETag names, e.g. "abc" becomes
+    // "abc-gzip" (a W/ prefix stays). Each coding is a representation of its own (RFC 9110
+    // section 8.8.3), so they must not share a strong ETag.
+    std::string EncodingETag(std::string_view etag, std::string_view coding);
+
+    // True if the request's Accept-Encoding allows the coding. Its own entry decides when there
+    // is one, otherwise *; only q=0 rules it out.
+    bool AcceptsEncoding(const httplib::Request&, std::string_view);
+};
+
+#endif 
@@ -0,0 +1,64 @@
+#ifndef EVENT_SERVER_HPP
+#define EVENT_SERVER_HPP
+
+#ifdef __linux__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Runtime.hpp"
+#include "httplib.h"
+
+namespace ProxySpace {
+    class EventLoop;
+    struct Listener;
+
+    // A non-blocking HTTP/1.1 front end, the alternative to httplib::Server for many mostly idle
+    // keep-alive clients. Connections are spread over a process-wide set of edge-triggered epoll
+    // loops, one per core by default, and hold no thread while idle. Requests are parsed on the
+    // loop thread and passed to the handler there, which either answers at once or returns the
+    // work that answers on one of the runtime's workers.
+    class EventServer {
+    public:
+        // Fills in the response on a worker.
+        using Deferred = std::function<void(const httplib::Request&, httplib::Response&)>;
+
+        // Answers on the loop thread and returns nullptr, or returns the work for a worker.
+        // Runs on the loop thread, so it must not block.
+        using Handler = std::function<Deferred(const httplib::Request&, httplib::Response&)>;
+
+        EventServer(std::shared_ptr<Runtime::Group> group, Handler handler, size_t max_payload);
+        ~EventServer();
+
+        // Sets the number of event loops; only has an effect before the first server listens.
+        static void Configure(size_t loops);
+
+        // Serves on host:port until Stop is called. False if the port could not be bound.
+        bool Listen(const std::string& host, int port);
+        void Stop();
+
+        int64_t Connections() const { return connections.load(std::memory_order_relaxed); }
+
+    private:
+        friend class EventLoop;
+
+        std::shared_ptr<Runtime::Group> group;
+        Handler handler;
+        size_t max_payload;
+        std::atomic<int64_t> connections{0};
+        int listen_fd{-1};
+        std::vector<std::unique_ptr<Listener>> listeners; // one per loop, all on listen_fd
+        std::mutex mtx;
+        std::condition_variable stopped_cv;
+        bool is_listening{false};
+    };
+}
+
+#endif
+
+#endif
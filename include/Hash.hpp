@@ -0,0 +1,22 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace CacheSpace {
+    // CRC32C (Castagnoli). Uses the SSE4.2 / ARMv8 CRC instructions when the CPU has them and
+    // a table otherwise, so the result is the same everywhere.
+    uint32_t Crc32c(std::string_view, uint32_t crc = 0);
+
+    // A body fingerprint: the CRC32C in the high half and the length in the low half.
+    inline uint64_t ContentHash(std::string_view body) {
+        return (static_cast<uint64_t>(Crc32c(body)) << 32) | static_cast<uint32_t>(body.size());
+    }
+
+    // A strong ETag for origins that send no validator of their own.
+    std::string SynthesizedETag(uint64_t);
+};
+
+#endif 
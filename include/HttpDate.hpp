@@ -0,0 +1,14 @@
+#ifndef HTTP_DATE_HPP
+#define HTTP_DATE_HPP
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace ProxySpace {
+    // Parses the three HTTP-date formats of RFC 9110 section 5.6.7 (IMF-fixdate, RFC 850 and
+    // asctime) into seconds since the Unix epoch.
+    std::optional<int64_t> ParseHttpDate(std::string_view);
+}
+
+#endif 
@@ -0,0 +1,39 @@
+#ifndef KEY_NORMALIZER_HPP
+#define KEY_NORMALIZER_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ProxySpace {
+    // Rewrites a request target into the cache key of the resource it names, so that equivalent
+    // URLs share one entry. The rules are compiled once per route; Normalize itself only
+    // allocates the returned key.
+    class KeyNormalizer {
+    public:
+        KeyNormalizer() = default;
+
+        // Parameter names ending in '*' match by prefix, e.g. "utm_*". A non-empty allow list
+        // drops every parameter that is not on it.
+        KeyNormalizer(bool sort_query, bool decode_percent, const std::vector<std::string>& drop_params, const std::vector<std::string>& allow_params);
+
+        std::string Normalize(std::string_view) const;
+
+        // The target with escapes of unreserved characters in its path decoded, which names the
+        // same resource. Routes are matched on this form, so that no target can be routed by
+        // its raw form and cached under another route's key.
+        static std::string DecodedPath(std::string_view target);
+
+    private:
+        bool KeepParam(std::string_view) const;
+
+        bool enabled{false};
+        bool sort_query{false};
+        bool decode_percent{false}; // only escapes of unreserved characters (RFC 3986 section 2.3)
+        std::vector<std::string> drop_names; // sorted
+        std::vector<std::string> drop_prefixes;
+        std::vector<std::string> allow_names; // sorted
+    };
+}
+
+#endif
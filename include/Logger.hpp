@@ -0,0 +1,75 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace ProxySpace {
+    enum class LogLevel : uint8_t { Debug, Info, Warn, Error, Off };
+
+    // An asynchronous logger. Each thread copies its records into a ring of its own, with no lock
+    // and no system call, and a single writer thread formats and writes them out. When a ring is
+    // full the record is dropped and counted rather than making the caller wait.
+    class Logger {
+    public:
+        static bool Enabled(LogLevel level) {
+            return level >= Instance().level.load(std::memory_order_relaxed);
+        }
+
+        // Messages longer than MESSAGE_SIZE are truncated.
+        static void Log(LogLevel, int port, std::string_view);
+
+        static void SetLevel(LogLevel level) { Instance().level.store(level, std::memory_order_relaxed); }
+        static LogLevel GetLevel() { return Instance().level.load(std::memory_order_relaxed); }
+        static uint64_t Dropped() { return Instance().dropped.load(std::memory_order_relaxed); }
+
+        static std::optional<LogLevel> ParseLevel(std::string_view);
+        static std::string_view LevelName(LogLevel);
+
+    private:
+        static constexpr size_t RING_SIZE = 1024; // records per thread, a power of two
+        static constexpr size_t MESSAGE_SIZE = 240;
+        static constexpr int64_t FLUSH_INTERVAL_MS = 10;
+
+        struct Record {
+            int64_t time_ms; // wall clock
+            int port;
+            LogLevel level;
+            uint16_t length;
+            char message[MESSAGE_SIZE];
+        };
+
+        // Single producer (the owning thread), single consumer (the writer).
+        struct Ring {
+            std::array<Record, RING_SIZE> records;
+            alignas(64) std::atomic<size_t> head{0}; // next slot the producer writes
+            alignas(64) std::atomic<size_t> tail{0}; // next slot the writer reads
+            std::atomic<bool> retired{false}; // the owning thread has exited
+        };
+
+        Logger();
+        ~Logger();
+        static Logger& Instance();
+        Ring& LocalRing();
+        void WriterFunction();
+        void Drain(std::string&);
+
+        std::atomic<LogLevel> level{LogLevel::Info};
+        std::atomic<uint64_t> dropped{0};
+        std::mutex rings_mtx; // guards rings and free_rings; threads only take it once, to register
+        std::vector<std::shared_ptr<Ring>> rings;
+        std::vector<std::shared_ptr<Ring>> free_rings; // drained rings of exited threads, for new threads to reuse
+        std::atomic<bool> is_running{true};
+        std::thread writer;
+    };
+}
+
+#endif
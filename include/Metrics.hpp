@@ -0,0 +1,101 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace ProxySpace {
+    // Metrics are recorded into one of METRIC_SHARDS copies, picked once per thread, so that a
+    // recording is a relaxed add to a cache line other threads rarely touch. Readers sum the
+    // shards, which may miss recordings that are in flight.
+    constexpr size_t METRIC_SHARDS = 16;
+
+    size_t ThreadShard();
+
+    class Counter {
+    public:
+        void Add(uint64_t n = 1) {
+            shards[ThreadShard()].value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        uint64_t Value() const;
+
+    private:
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> value{0};
+        };
+
+        std::array<Shard, METRIC_SHARDS> shards;
+    };
+
+    // A log-linear histogram of microsecond values. Every power of two is split into SUB_BUCKETS
+    // equal buckets, so a bucket is never wider than a quarter of the values it holds.
+    class Histogram {
+    public:
+        static constexpr int SUB_BUCKET_BITS = 2;
+        static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+        static constexpr int MAX_BITS = 28; // about 268 s; slower values land in the last bucket
+        static constexpr int BUCKETS = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+        struct Snapshot {
+            std::array<uint64_t, BUCKETS> counts{};
+            uint64_t count{0};
+            uint64_t sum{0};
+        };
+
+        void Record(int64_t micros) {
+            uint64_t value = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+            Shard& shard = shards[ThreadShard()];
+            shard.counts[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+            shard.sum.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        // Buckets hold the values above the previous bucket's bound up to and including their own,
+        // as Prometheus reads le, so the value one below decides.
+        static int BucketIndex(uint64_t value) {
+            uint64_t below = value > 0 ? value - 1 : 0;
+
+            if (below < SUB_BUCKETS) {
+                return static_cast<int>(below);
+            }
+
+            int shift = std::bit_width(below) - 1 - SUB_BUCKET_BITS;
+            int index = (shift + 1) * SUB_BUCKETS + static_cast<int>((below >> shift) & (SUB_BUCKETS - 1));
+
+            return std::min(index, BUCKETS - 1);
+        }
+
+        // Values in the bucket are at most this, except in the last one, which takes every slower value.
+        static uint64_t BucketUpperBound(int index) {
+            if (index < SUB_BUCKETS) {
+                return static_cast<uint64_t>(index) + 1;
+            }
+
+            int shift = index / SUB_BUCKETS - 1;
+            return static_cast<uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS + 1) << shift;
+        }
+
+        Snapshot Read() const;
+
+    private:
+        struct alignas(64) Shard {
+            std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+            std::atomic<uint64_t> sum{0};
+        };
+
+        std::array<Shard, METRIC_SHARDS> shards;
+    };
+
+    // Prometheus text exposition format (version 0.0.4). Histograms are exported in seconds.
+    void AppendMetricHeader(std::string&, std::string_view name, std::string_view type, std::string_view help);
+    void AppendMetric(std::string&, std::string_view name, std::string_view labels, double value);
+    void AppendHistogram(std::string&, std::string_view name, std::string_view labels, const Histogram&);
+    std::string EscapeLabel(std::string_view);
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef MISS_RATIO_ESTIMATOR_HPP
+#define MISS_RATIO_ESTIMATOR_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+namespace CacheSpace {
+    // Estimates the hit ratio the cache would have at other capacities (SHARDS, Waldspurger et
+    // al., FAST '15). Keys are sampled by hash at a rate R, and the sampled stream runs through
+    // ghost LRUs of R times each target capacity that hold only key hashes. R is picked so that
+    // the largest ghost holds at most max_samples keys, which bounds memory whatever the
+    // capacity. Not thread safe; the cache calls it under its lock.
+    class MissRatioEstimator {
+    public:
+        static constexpr std::array<double, 4> SCALES = {0.5, 1.0, 2.0, 4.0};
+
+        struct Estimate {
+            double scale;
+            size_t capacity;
+            double hit_ratio;
+        };
+
+        struct Curve {
+            std::vector<Estimate> points; // one per scale
+            double sample_rate;
+            uint64_t samples; // since the last Resize
+            bool warm; // the largest ghost has had time to fill
+        };
+
+        explicit MissRatioEstimator(size_t capacity, size_t max_samples = 16384);
+
+        void Access(uint64_t hash);
+        void Resize(size_t capacity); // starts over with ghosts for the new capacity
+        Curve Estimates() const;
+
+    private:
+        static constexpr uint64_t SAMPLE_SPACE = uint64_t{1} << 24;
+        static constexpr uint64_t DECAY_EVERY = 1 << 16; // sampled accesses between halvings
+
+        struct Ghost {
+            size_t capacity;
+            std::list<uint64_t> lru;
+            std::unordered_map<uint64_t, std::list<uint64_t>::iterator> index;
+            double hits{0};
+            double accesses{0};
+        };
+
+        size_t capacity;
+        size_t max_samples;
+        uint64_t threshold{0};
+        uint64_t samples{0};
+        std::array<Ghost, SCALES.size()> ghosts;
+    };
+};
+
+#endif
@@ -4,21 +4,75 @@
 #include <string>
 #include <memory>
 #include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
 #include <thread>
+#include <unordered_set>
+#include "AccessLog.hpp"
 #include "Cache.hpp"
+#include "CacheControl.hpp"
+#include "EventServer.hpp"
+#include "KeyNormalizer.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "RouteTrie.hpp"
+#include "Runtime.hpp"
 #include "httplib.h"
 
 namespace ProxySpace {
+    // Settings that a route may override. Routes start out with the proxy's values.
+    struct RoutePolicy {
+        int64_t ttl_ms{4000}; // may be sub-second, used when the origin gives no freshness information
+        double heuristic_fraction{0.1}; // of the time since Last-Modified, RFC 9111 section 4.2.2
+        int64_t heuristic_max_ttl_ms{24 * 60 * 60 * 1000};
+        size_t max_response_size{2 * 1024 * 1024}; // bigger bodies are cached in segments
+        size_t max_object_size{1024 * 1024 * 1024}; // bigger bodies are rejected, 0 disables segments
+        size_t segment_size{1024 * 1024};
+        int segment_parallelism{4}; // concurrent origin connections per segmented response
+        bool compress_in_cache{true}; // store compressible bodies gzipped
+        size_t compress_min_size{1024};
+        std::string upstream_encoding{"gzip"}; // what to ask origins for: "gzip" or "identity"
+
+        // Vary normalization: requests are keyed (and forwarded) by bucket instead of raw value.
+        std::vector<std::string> vary_languages; // Accept-Language buckets, empty keeps raw values
+        bool vary_device_class{false}; // User-Agent bucketed by DeviceClass
+
+        KeyNormalizer key_normalizer; // keys are the request target as is unless configured
+    };
+
     struct RouteConfig {
         std::string prefix;  
         std::string origin; 
+        RoutePolicy policy;
+    };
+
+    // Lets the proxy double or halve cache_size from the estimated hit ratios. Disabled while
+    // max_size is 0.
+    struct CapacityTuning {
+        int min_size{0};
+        int max_size{0};
+        size_t max_bytes{0}; // cached bodies the grown cache may be expected to hold, 0 is unlimited
+        int64_t interval_ms{60 * 1000};
+        double min_gain{0.02}; // hit ratio that doubling must add; halving must lose under a tenth of it
+
+        bool Enabled() const { return max_size > 0; }
     };
 
     struct ProxyConfig {
         int port{9090};
         std::string origin_url; // default
         int cache_size{15};
-        int ttl{4}; // in seconds
+        RoutePolicy policy;
+        int decompressed_cache_size{32}; // identity copies of hot gzip entries
+        double early_refresh_beta{0.0}; // 0 disables probabilistic early refresh
+        std::string access_log_path; // empty disables the access log
+        size_t access_log_max_size{100 * 1024 * 1024}; // rotate once the file would grow past this
+        int access_log_max_files{5}; // rotated files kept besides the current one
+        CapacityTuning capacity_tuning;
+        int weight{1}; // share of the process's worker threads relative to the other proxies
+        size_t max_queued_connections{100}; // accepted connections waiting for a worker, beyond this they are closed
+        std::string front_end{"httplib"}; // or "epoll", see EventServer
         std::vector<ProxySpace::RouteConfig> routes; 
     }; 
 
@@ -35,49 +89,128 @@ namespace ProxySpace {
     };
 
     static const std::array<std::string_view, 5> PROXY_FIELDS = {
-        "port", "origin_url", "cache_size", "ttl",
+        "port", "origin_url", "cache_size", "ttl_ms",
+    };
+    using HttpClient = std::unique_ptr<httplib::Client>;
+
+    // Recorded for every proxied request and exported by /metrics.
+    struct RouteMetrics {
+        std::array<Histogram, 5> latency; // indexed by CacheOutcome
+        Histogram origin_latency; // request start until the response headers, connect included
+        Counter bytes_served;
+    };
+
+    // A route resolved at startup: everything a request needs once its prefix has matched.
+    struct Route {
+        std::string prefix;
+        std::string origin;
+        RoutePolicy policy;
+        httplib::Client* client;
+        std::shared_ptr<RouteMetrics> metrics;
     };
-    using HttpClient = std::unique_ptr<httplib::SSLClient>;
+
+    // A request the event front end looked up on its loop thread before handing it to a worker.
+    struct EarlyLookup {
+        CacheSpace::Lookup lookup;
+        int64_t start_us{0};
+        int64_t key_built_us{0};
+        int64_t cache_lookup_us{0};
+    };
+
     using CommandFunc = std::function<void(const httplib::Request&, httplib::Response&)>;
 
     class Proxy {
     public:
-        explicit Proxy(const ProxyConfig &config) : config(config), cache(config.cache_size, config.ttl) {
+        explicit Proxy(const ProxyConfig &config) : config(config), cache(config.cache_size, config.policy.ttl_ms),
+            decompressed_cache(config.decompressed_cache_size, config.policy.ttl_ms),
+            group(Runtime::Instance().CreateGroup(config.port, config.weight, config.max_queued_connections)) {
             BuildClients();
+            BuildRoutes();
             BuildEndpoints();
+
+            if (!config.access_log_path.empty()) {
+                access_log = std::make_unique<AccessLog>(config.access_log_path, config.access_log_max_size, config.access_log_max_files);
+            }
         }
         ~Proxy() {
             is_running = false;
 
-            if (ttl_thread.joinable()) {
-                ttl_thread.join();
-            }
-
             for (auto& [_, client] : clients) {
                 client->stop();
             }
 
             svr.stop();
+
+#ifdef __linux__
+            if (event_server) {
+                event_server->Stop();
+            }
+#endif
+
+            // Nothing queued for this proxy may run once it is gone.
+            group->Shutdown();
         }
-        std::string MakeCacheKey(const httplib::Request&, const std::string&) const;
+        std::string MakeCacheKey(const Route&, const httplib::Request&) const;
+        static std::vector<std::string> ParseVary(const std::string&);
+        static std::optional<std::string_view> NormalizedValue(const RoutePolicy&, const std::string&, const httplib::Request&);
+        static uint64_t VariantHash(const RoutePolicy&, const httplib::Request&, const std::vector<std::string>&);
         void StartServer();
         void BuildClients();
+        void BuildRoutes();
         void BuildEndpoints();
-        bool CheckCacheForResponse(const std::string&, const std::string&, httplib::Response&);
-        void HandleRequest(const httplib::Request&, httplib::Response&);
+        CacheSpace::Lookup LookUp(const Route&, const std::string&, const httplib::Request&);
+        bool CheckCacheForResponse(const Route&, const CacheSpace::Lookup&, const httplib::Request&, httplib::Response&);
+        void ServeFresh(const Route&, const std::string&, const std::shared_ptr<CacheSpace::CachedResponse>&, const httplib::Request&, httplib::Response&, int64_t now);
+        void ServeCached(const Route&, const std::string&, const std::shared_ptr<CacheSpace::CachedResponse>&, const httplib::Request&, httplib::Response&, bool store_segments = true);
+        std::shared_ptr<CacheSpace::CachedResponse> Decompressed(const Route&, const std::string&, const std::shared_ptr<CacheSpace::CachedResponse>&);
+        void CompressForStorage(CacheSpace::CachedResponse&, const RoutePolicy&);
+        bool WriteSegments(const Route&, const std::string&, const std::string&, const std::shared_ptr<CacheSpace::CachedResponse>&, bool, size_t, size_t, httplib::DataSink&);
+        std::vector<std::shared_ptr<CacheSpace::CachedResponse>> FetchSegments(const Route&, const std::string&, const std::string&, const CacheSpace::CachedResponse&, const std::vector<size_t>&, bool);
+        static bool IsNotModified(const httplib::Request&, const CacheSpace::CachedResponse&);
+        bool RangeApplies(const httplib::Request&, const CacheSpace::CachedResponse&) const;
+        static bool RangesSatisfiable(const httplib::Ranges&, size_t);
+        void HandleRequest(const httplib::Request&, httplib::Response&, const EarlyLookup* = nullptr);
+        bool TryServeHit(const httplib::Request&, httplib::Response&, EarlyLookup&);
+        void FinishRequest(const Route&, const std::string&, const httplib::Response&, int64_t start_us, int64_t key_built_us);
+        void Respond(const Route&, const std::string&, const CacheSpace::Lookup&, const httplib::Request&, httplib::Response&);
+        std::optional<std::string> FetchFromOrigin(const Route&, const httplib::Request&, httplib::Response&);
+        bool ShouldRefreshEarly(const CacheSpace::CachedResponse&, int64_t) const;
+        void ScheduleRefresh(const std::string&, const httplib::Request&);
         bool MatchesEndpoint(const std::string&, const httplib::Request&, httplib::Response&);
-        std::optional<int64_t> ParseMaxAge(const std::string&);
-        void LogMessage(const std::string&);
-        std::string SelectOrigin(const std::string&) const;
+        static int64_t FreshnessMillis(int, const CacheControl&, const httplib::Headers&, const RoutePolicy&, int64_t);
+        bool ServeStaleOnError(const Route&, const std::string&, const httplib::Request&, httplib::Response&);
+        void LogMessage(LogLevel, std::string_view);
+        std::string RenderMetrics() const;
+        const Route& SelectRoute(const std::string&) const;
+        static HttpClient CreateClient(const std::string&);
+        HttpClient AcquireClient(const std::string&);
+        void ReleaseClient(const std::string&, HttpClient);
 
     private:
         std::unordered_map<std::string, CommandFunc> endpoints;
-        void TTLFunction();
-        std::thread ttl_thread;
+        void ExpireEntries();
+        void TuneCapacity();
+        void DrainRefreshes();
+        std::mutex refresh_mtx;
+        std::queue<std::pair<std::string, httplib::Request>> refresh_queue;
+        std::unordered_set<std::string> pending_refreshes;
+        bool is_refreshing{false}; // a DrainRefreshes task is queued or running; guarded by refresh_mtx
+        int64_t next_tune_ms{0};
         CacheSpace::Cache cache;
+        CacheSpace::Cache decompressed_cache;
         ProxyConfig config;
         std::unordered_map<std::string, ProxySpace::HttpClient> clients;
+        std::mutex client_pool_mtx;
+        std::unordered_map<std::string, std::vector<HttpClient>> client_pool; // idle keep-alive clients for segment fetches
+        std::vector<Route> routes; // [0] is the default route
+        RouteTrie<const Route*> route_trie;
+        std::unique_ptr<AccessLog> access_log;
+        std::atomic<int64_t> origin_in_flight{0};
+        std::shared_ptr<Runtime::Group> group; // this proxy's share of the process-wide workers
         httplib::Server svr;
+#ifdef __linux__
+        std::unique_ptr<EventServer> event_server; // serves instead of svr when front_end is "epoll"
+#endif
         std::atomic<bool> is_running{true};
     };
 }
@@ -0,0 +1,110 @@
+#ifndef ROUTE_TRIE_HPP
+#define ROUTE_TRIE_HPP
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ProxySpace {
+    // A radix trie over route prefixes. Lookups walk the path once and return the value of the
+    // longest prefix that matches, so the order routes were configured in does not matter.
+    template <typename T>
+    class RouteTrie {
+    public:
+        // False, leaving the trie as it was, if the prefix already has a value.
+        bool Insert(std::string_view prefix, T value) {
+            Node* node = &root;
+
+            while (!prefix.empty()) {
+                Node* child = node->FindChild(prefix.front());
+
+                if (!child) {
+                    auto leaf = std::make_unique<Node>();
+                    leaf->label = prefix;
+                    leaf->value = std::move(value);
+                    node->children.push_back(std::move(leaf));
+                    return true;
+                }
+
+                size_t common = CommonPrefixLength(child->label, prefix);
+
+                if (common < child->label.size()) {
+                    // Split the edge so that the shared part becomes its own node.
+                    auto tail = std::make_unique<Node>();
+                    tail->label = child->label.substr(common);
+                    tail->value = std::move(child->value);
+                    tail->children = std::move(child->children);
+                    child->label.resize(common);
+                    child->value.reset();
+                    child->children.clear();
+                    child->children.push_back(std::move(tail));
+                }
+
+                node = child;
+                prefix.remove_prefix(common);
+            }
+
+            if (node->value) {
+                return false;
+            }
+
+            node->value = std::move(value);
+            return true;
+        }
+
+        const T* LongestPrefixMatch(std::string_view path) const {
+            const Node* node = &root;
+            const T* best = root.value ? &*root.value : nullptr;
+
+            while (!path.empty()) {
+                const Node* child = node->FindChild(path.front());
+
+                if (!child || !path.starts_with(child->label)) {
+                    break;
+                }
+
+                path.remove_prefix(child->label.size());
+                node = child;
+
+                if (node->value) {
+                    best = &*node->value;
+                }
+            }
+
+            return best;
+        }
+
+    private:
+        struct Node {
+            std::string label; // the edge leading into this node
+            std::optional<T> value;
+            std::vector<std::unique_ptr<Node>> children; // one per distinct first byte
+
+            Node* FindChild(char first) const {
+                for (const auto& child : children) {
+                    if (child->label.front() == first) {
+                        return child.get();
+                    }
+                }
+
+                return nullptr;
+            }
+        };
+
+        static size_t CommonPrefixLength(std::string_view a, std::string_view b) {
+            size_t length = 0;
+
+            while (length < a.size() && length < b.size() && a[length] == b[length]) {
+                length++;
+            }
+
+            return length;
+        }
+
+        Node root;
+    };
+}
+
+#endif 
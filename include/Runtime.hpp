@@ -0,0 +1,145 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "httplib.h"
+
+namespace ProxySpace {
+    // The worker threads and the timer thread shared by every proxy in the process.
+    //
+    // Work submitted from outside the runtime (accepted connections, timers) waits in a queue
+    // per group, one group per proxy, and idle workers take from the group that is furthest
+    // behind its weighted share (stride scheduling). A group already running its share of the
+    // workers only gets another while no other group has work queued, since a task can hold its
+    // worker for as long as a keep-alive connection stays open. Work submitted by a worker goes
+    // on that worker's own deque, which it pops newest first and other workers steal from
+    // oldest first.
+    class Runtime {
+    public:
+        class Group : public std::enable_shared_from_this<Group> {
+        public:
+            // False when the group is full or shutting down; the caller drops the work.
+            bool Submit(std::function<void()>);
+
+            // Runs fn on a worker after delay_ms, unless the group has been shut down by then.
+            void After(int64_t delay_ms, std::function<void()>);
+
+            // Stops accepting work and waits for what was accepted to finish. Idempotent.
+            void Shutdown();
+
+            int64_t Queued() const { return queued.load(std::memory_order_relaxed); }
+            int64_t Running() const { return running.load(std::memory_order_relaxed); }
+            int Port() const { return port; }
+
+        private:
+            friend class Runtime;
+
+            Group(Runtime& runtime, int port, int weight, size_t max_queued);
+
+            Runtime& runtime;
+            int port;
+            int weight;
+            uint64_t stride;
+            size_t max_queued;
+            uint64_t pass{0}; // guarded by runtime.mtx, like tasks
+            std::deque<std::function<void()>> tasks;
+            std::atomic<bool> is_open{true};
+            std::atomic<int64_t> queued{0};
+            std::atomic<int64_t> running{0};
+            std::atomic<int64_t> outstanding{0}; // accepted and not yet finished
+            std::mutex drain_mtx;
+            std::condition_variable drain_cv;
+        };
+
+        // Sets the number of workers; only has an effect before the runtime is first used.
+        static void Configure(size_t threads);
+        static Runtime& Instance();
+
+        std::shared_ptr<Group> CreateGroup(int port, int weight, size_t max_queued);
+
+        size_t Threads() const { return workers.size(); }
+        uint64_t Steals() const { return steals.load(std::memory_order_relaxed); }
+
+    private:
+        static constexpr uint64_t STRIDE_BASE = uint64_t{1} << 20;
+        static constexpr uint64_t GLOBAL_CHECK_EVERY = 61; // local tasks cannot starve the groups
+
+        struct Task {
+            std::shared_ptr<Group> group;
+            std::function<void()> fn;
+        };
+
+        struct Worker {
+            std::mutex mtx;
+            std::deque<Task> local;
+            std::thread thread;
+        };
+
+        struct Timer {
+            std::chrono::steady_clock::time_point due;
+            uint64_t sequence; // keeps timers due at the same time in order
+            std::shared_ptr<Group> group;
+            std::function<void()> fn;
+
+            bool operator>(const Timer& other) const {
+                return due != other.due ? due > other.due : sequence > other.sequence;
+            }
+        };
+
+        explicit Runtime(size_t threads);
+        ~Runtime();
+
+        bool Push(const std::shared_ptr<Group>&, std::function<void()>, bool bounded);
+        int64_t Share(const Group&) const;
+        bool PopGlobal(Task&);
+        bool PopLocal(size_t worker, Task&);
+        bool Steal(size_t worker, Task&);
+        void Run(Task&);
+        void WorkerFunction(size_t worker);
+        void TimerFunction();
+
+        static std::atomic<size_t> configured_threads;
+
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::mutex mtx; // guards the group queues and active_groups
+        std::condition_variable work_cv;
+        std::vector<std::shared_ptr<Group>> active_groups; // groups with queued tasks
+        uint64_t virtual_time{0}; // pass of the group picked last
+        int64_t total_weight{0}; // of the open groups
+        std::atomic<size_t> sleeping{0};
+        std::atomic<int64_t> pending{0}; // tasks queued anywhere
+        std::atomic<uint64_t> steals{0};
+
+        std::mutex timer_mtx;
+        std::condition_variable timer_cv;
+        std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+        uint64_t timer_sequence{0};
+        std::thread timer_thread;
+
+        std::atomic<bool> is_running{true};
+    };
+
+    // Lets httplib::Server hand its accepted connections to a runtime group.
+    class RuntimeTaskQueue : public httplib::TaskQueue {
+    public:
+        explicit RuntimeTaskQueue(std::shared_ptr<Runtime::Group> group) : group(std::move(group)) {}
+
+        bool enqueue(std::function<void()> fn) override { return group->Submit(std::move(fn)); }
+        void shutdown() override { group->Shutdown(); }
+
+    private:
+        std::shared_ptr<Runtime::Group> group;
+    };
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef URL_STATS_HPP
+#define URL_STATS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CacheSpace {
+    struct UrlCounts {
+        std::string url;
+        int64_t hits;
+        int64_t misses;
+
+        int64_t Requests() const { return hits + misses; }
+    };
+
+    struct UrlStatsQuery {
+        std::string prefix; // only URLs starting with it
+        std::string cursor; // only URLs ordered after it, i.e. the last URL of the previous page
+        size_t limit{100};
+        bool top{false}; // most requested first instead of URL order, the cursor is ignored
+    };
+
+    // Hit and miss counts per URL, kept apart from the cache lock. URLs are spread over shards,
+    // and the counters of a URL seen before are bumped under a shared lock, so recording only
+    // serializes on the first request for a URL. A query holds one shard's shared lock at a time
+    // and copies no more than `limit` entries per shard.
+    class UrlStats {
+    public:
+        void Record(const std::string&, bool);
+        std::vector<UrlCounts> Query(const UrlStatsQuery&) const;
+        bool Empty() const;
+        void Clear();
+
+    private:
+        static constexpr size_t SHARDS = 16;
+
+        struct Counts {
+            std::atomic<int64_t> hits{0};
+            std::atomic<int64_t> misses{0};
+        };
+
+        struct alignas(64) Shard {
+            mutable std::shared_mutex mtx;
+            std::unordered_map<std::string, Counts> urls;
+        };
+
+        Shard& ShardFor(const std::string& url) {
+            return shards[std::hash<std::string>{}(url) % SHARDS];
+        }
+
+        std::array<Shard, SHARDS> shards;
+    };
+};
+
+#endif
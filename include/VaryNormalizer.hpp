@@ -0,0 +1,18 @@
+#ifndef VARY_NORMALIZER_HPP
+#define VARY_NORMALIZER_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ProxySpace {
+    // The configured language the client prefers most, going by the q-values of its
+    // Accept-Language. Region subtags are ignored ("en-GB" picks "en"), "*" picks the first
+    // configured language, and no match gives the empty string.
+    std::string_view LanguageBucket(std::string_view, const std::vector<std::string>&);
+
+    // Coarse device class of a User-Agent: "bot", "tablet", "mobile" or "desktop".
+    std::string_view DeviceClass(std::string_view);
+}
+
+#endif 
@@ -0,0 +1,137 @@
+#include "AccessLog.hpp"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+
+std::string_view ProxySpace::OutcomeName(CacheOutcome outcome) {
+    switch (outcome) {
+        case CacheOutcome::Hit: return "HIT";
+        case CacheOutcome::Miss: return "MISS";
+        case CacheOutcome::Revalidated: return "REVALIDATED";
+        case CacheOutcome::Stale: return "STALE";
+        default: return "COALESCED";
+    }
+}
+
+ProxySpace::AccessLog::AccessLog(std::string path, size_t max_size, int max_files)
+    : path(std::move(path)), max_size(max_size), max_files(max_files) {
+    file.open(this->path, std::ios::app);
+
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open access log " + this->path + "!");
+    }
+
+    std::error_code ec;
+    file_size = std::filesystem::file_size(this->path, ec);
+    writer = std::thread(&ProxySpace::AccessLog::WriterFunction, this);
+}
+
+ProxySpace::AccessLog::~AccessLog() {
+    {
+        std::lock_guard lock(mtx);
+        is_running = false;
+    }
+
+    cv.notify_one();
+
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void ProxySpace::AccessLog::Write(AccessRecord record) {
+    bool wake = false;
+
+    {
+        std::lock_guard lock(mtx);
+
+        if (pending.size() >= MAX_PENDING) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        pending.push_back(std::move(record));
+        wake = pending.size() == BATCH_SIZE;
+    }
+
+    if (wake) {
+        cv.notify_one();
+    }
+}
+
+// path.N-1 -> path.N, ..., path -> path.1; the oldest file falls off the end.
+void ProxySpace::AccessLog::Rotate() {
+    file.close();
+    std::error_code ec;
+
+    for (int i = max_files - 1; i >= 1; i--) {
+        std::filesystem::rename(path + "." + std::to_string(i), path + "." + std::to_string(i + 1), ec);
+    }
+
+    if (max_files > 0) {
+        std::filesystem::rename(path, path + ".1", ec);
+    } else {
+        std::filesystem::remove(path, ec);
+    }
+
+    file.open(path, std::ios::trunc);
+    file_size = 0;
+}
+
+void ProxySpace::AccessLog::WriterFunction() {
+    std::vector<AccessRecord> batch;
+    std::string out;
+    bool running = true;
+
+    while (running) {
+        {
+            std::unique_lock lock(mtx);
+            cv.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL_MS), [this] {
+                return pending.size() >= BATCH_SIZE || !is_running;
+            });
+
+            batch.swap(pending);
+            running = is_running;
+        }
+
+        if (batch.empty()) {
+            continue;
+        }
+
+        out.clear();
+
+        for (const auto& record : batch) {
+            nlohmann::ordered_json j; // fields in declaration order
+            j["timestamp_ms"] = record.timestamp_ms;
+            j["port"] = record.port;
+            j["route"] = record.route;
+
+            char key_hash[17];
+            std::snprintf(key_hash, sizeof(key_hash), "%016llx", static_cast<unsigned long long>(record.key_hash));
+            j["key_hash"] = key_hash;
+
+            j["outcome"] = OutcomeName(record.outcome);
+            j["status"] = record.status;
+            j["bytes"] = record.bytes;
+            j["key_build_us"] = record.key_build_us;
+            j["cache_lookup_us"] = record.cache_lookup_us;
+            j["origin_connect_us"] = record.origin_connect_us;
+            j["origin_ttfb_us"] = record.origin_ttfb_us;
+            j["total_us"] = record.total_us;
+            out += j.dump();
+            out += '\n';
+        }
+
+        batch.clear();
+
+        if (max_size > 0 && file_size > 0 && file_size + out.size() > max_size) {
+            Rotate();
+        }
+
+        file.write(out.data(), static_cast<std::streamsize>(out.size()));
+        file.flush();
+        file_size += out.size();
+    }
+}
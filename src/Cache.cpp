@@ -1,5 +1,15 @@
 #include "Cache.hpp"
-#include <chrono>
+#include <algorithm>
+
+namespace {
+    // Spreads std::hash output over all 64 bits (SplitMix64's finalizer); the estimator
+    // samples on the low bits.
+    uint64_t MixHash(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+}
 
 std::shared_ptr<CacheSpace::CachedResponse> CacheSpace::Cache::get(const std::string& url) {
     std::unique_lock lock(mtx); 
@@ -12,43 +22,148 @@ std::shared_ptr<CacheSpace::CachedResponse> CacheSpace::Cache::get(const std::st
 
     cache_list.splice(cache_list.begin(), cache_list, it->second);
 
-    return it->second->second; 
+    return it->second->response; 
+}
+
+// The variant of url that matches the request, found with a single lookup. variant_of is only
+// called when the URL varies, with the header names its responses vary on.
+CacheSpace::Lookup CacheSpace::Cache::Find(const std::string& url, const VariantHasher& variant_of) {
+    uint64_t hash = MixHash(std::hash<std::string>{}(url));
+    std::unique_lock lock(mtx);
+
+    estimator.Access(hash);
+    auto it = primaries.find(url);
+
+    if (it == primaries.end()) {
+        return {};
+    }
+
+    uint64_t variant = it->second.vary.empty() ? 0 : variant_of(it->second.vary);
+
+    for (auto& [hash, entry] : it->second.variants) {
+        if (hash == variant) {
+            cache_list.splice(cache_list.begin(), cache_list, entry);
+            return {entry->key, entry->response};
+        }
+    }
+
+    return {};
 }
 
 void CacheSpace::Cache::put(const std::string& url, const CachedResponse& cached) {
+    put(url, std::make_shared<CachedResponse>(cached));
+}
+
+void CacheSpace::Cache::put(const std::string& url, std::shared_ptr<CachedResponse> cached) {
+    std::unique_lock lock(mtx);
+    Insert(url, std::move(cached));
+}
+
+// Stores the response to a request for url as the variant selected by the request's values of
+// the vary headers. Returns the key it is stored under.
+std::string CacheSpace::Cache::Store(const std::string& url, const std::vector<std::string>& vary, uint64_t variant, std::shared_ptr<CachedResponse> cached) {
     std::unique_lock lock(mtx);
+    std::string key = VariantKey(url, variant);
+    auto primary_it = primaries.find(url);
+
+    // Variants were selected by the old Vary list, so none of them can be matched any more.
+    if (primary_it != primaries.end() && primary_it->second.vary != vary) {
+        auto variants = primary_it->second.variants;
+
+        for (auto& [hash, entry] : variants) {
+            Erase(entry, EvictionReason::Superseded);
+        }
+    }
+
+    auto entry = Insert(key, std::move(cached));
+    auto& primary = *primaries.try_emplace(url).first;
+    primary.second.vary = vary;
+    entry->primary = &primary;
+
+    auto& variants = primary.second.variants;
+    auto variant_it = std::find_if(variants.begin(), variants.end(), [&](const auto& v) { return v.first == variant; });
 
+    if (variant_it == variants.end()) {
+        variants.emplace_back(variant, entry);
+    }
+
+    return key;
+}
+
+std::list<CacheSpace::CacheEntry>::iterator CacheSpace::Cache::Insert(const std::string& url, std::shared_ptr<CachedResponse> cached) {
+    int64_t evict_at = cached->EvictAt(cached->expires_at);
     auto it = cache_map.find(url);
 
+    int64_t size = static_cast<int64_t>(cached->body.size());
+
     if (it != cache_map.end()) {
-        it->second->second = std::make_shared<CachedResponse>(cached);
+        stored_bytes.fetch_add(size - static_cast<int64_t>(it->second->response->body.size()), std::memory_order_relaxed);
+        it->second->response = std::move(cached);
         cache_list.splice(cache_list.begin(), cache_list, it->second);
     } else {
         if (cache_list.size() >= capacity) {
-            auto& last = cache_list.back();
-            cache_map.erase(last.first);
-            cache_list.pop_back();
+            Erase(std::prev(cache_list.end()), EvictionReason::Capacity);
         }
 
-        cache_list.emplace_front(
-            url,
-            std::make_shared<CachedResponse>(cached)
-        );
-
+        cache_list.push_front({url, std::move(cached)});
         cache_map[url] = cache_list.begin();
+        entry_count.fetch_add(1, std::memory_order_relaxed);
+        stored_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    min_heap.push({url, evict_at});
+    ttl_cv.notify_one();
+
+    return cache_list.begin();
+}
+
+// Removes the entry along with its place in the variant table of its URL.
+void CacheSpace::Cache::Erase(std::list<CacheEntry>::iterator entry, EvictionReason reason) {
+    evictions[static_cast<size_t>(reason)].fetch_add(1, std::memory_order_relaxed);
+    entry_count.fetch_sub(1, std::memory_order_relaxed);
+    stored_bytes.fetch_sub(static_cast<int64_t>(entry->response->body.size()), std::memory_order_relaxed);
+
+    if (entry->primary) {
+        auto& variants = entry->primary->second.variants;
+        std::erase_if(variants, [&](const auto& v) { return v.second == entry; });
+
+        if (variants.empty()) {
+            primaries.erase(primaries.find(entry->primary->first));
+        }
+    }
+
+    cache_map.erase(entry->key);
+    cache_list.erase(entry);
+}
+
+// Extends the expiry of the entry stored under url without replacing it, provided it is
+// still the same version (generation) of the object.
+bool CacheSpace::Cache::Renew(const std::string& url, int64_t generation, int64_t expires_at) {
+    std::unique_lock lock(mtx);
+    auto it = cache_map.find(url);
+
+    if (it == cache_map.end() || it->second->response->generation != generation) {
+        return false;
     }
 
-    min_heap.push({url, cached.expires_at});
+    auto& entry = it->second->response;
+    std::atomic_ref<int64_t>(entry->expires_at).store(expires_at, std::memory_order_relaxed);
+    min_heap.push({url, entry->EvictAt(expires_at)});
     ttl_cv.notify_one();
+
+    return true;
 }
 
 void CacheSpace::Cache::clear() {
     std::unique_lock lock(mtx);
 
+    evictions[static_cast<size_t>(EvictionReason::Cleared)].fetch_add(cache_list.size(), std::memory_order_relaxed);
+    entry_count.store(0, std::memory_order_relaxed);
+    stored_bytes.store(0, std::memory_order_relaxed);
     cache_list.clear();
     cache_map.clear();
-    url_hits_and_misses.clear();
-    vary_specs.clear();
+    primaries.clear();
+    url_stats.Clear();
     
     // Since there is no "clear" method for the min heap.
     while (!min_heap.empty()) {
@@ -56,23 +171,37 @@ void CacheSpace::Cache::clear() {
     }
 }
 
-void CacheSpace::Cache::IncrementURLHitsOrMisses(const std::string& key, bool is_hit) {
+int CacheSpace::Cache::GetCapacity() const {
+    std::shared_lock lock(mtx);
+    return capacity;
+}
+
+void CacheSpace::Cache::SetCapacity(int new_capacity) {
     std::unique_lock lock(mtx);
+    capacity = std::max(new_capacity, 1);
 
-    if (!url_hits_and_misses.contains(key)) {
-        url_hits_and_misses[key] = {0, 0};
+    while (cache_list.size() > static_cast<size_t>(capacity)) {
+        Erase(std::prev(cache_list.end()), EvictionReason::Capacity);
     }
 
-    url_hits_and_misses[key].first += is_hit ? 1 : 0;
-    url_hits_and_misses[key].second += is_hit ? 0 : 1;
+    estimator.Resize(capacity);
 }
 
-int64_t CacheSpace::Cache::GetCurrentSeconds() {
-    auto now = std::chrono::system_clock::now();
+CacheSpace::MissRatioEstimator::Curve CacheSpace::Cache::EstimateHitRatios() const {
+    std::shared_lock lock(mtx);
+    return estimator.Estimates();
+}
+
+// Caps how long the expiry timer waits, so that sub-second TTLs are honored promptly.
+int64_t CacheSpace::Cache::MillisUntilNextExpiry() const {
+    constexpr int64_t MAX_WAIT_MS = 1000;
+    std::shared_lock lock(mtx);
+
+    if (min_heap.empty()) {
+        return MAX_WAIT_MS;
+    }
 
-    return std::chrono::duration_cast<std::chrono::seconds>(
-        now.time_since_epoch()
-    ).count();
+    return std::clamp<int64_t>(min_heap.top().second - GetCurrentMillis(), 1, MAX_WAIT_MS);
 }
 
 bool CacheSpace::Cache::CheckHeapTop() {
@@ -80,22 +209,22 @@ bool CacheSpace::Cache::CheckHeapTop() {
 
     if (min_heap.empty()) return false;
 
-    auto [url, expires_at] = min_heap.top();
+    auto [url, evict_at] = min_heap.top();
     auto it = cache_map.find(url);
 
-    if (it == cache_map.end() || it->second->second->expires_at != expires_at) {
+    // Heap records left behind by put or Renew no longer match the entry.
+    if (it == cache_map.end() || it->second->response->EvictAt(it->second->response->expires_at) != evict_at) {
         min_heap.pop();
         return true;
     }
 
-    int64_t now = GetCurrentSeconds();
+    int64_t now = GetCurrentMillis();
 
-    if (now < expires_at) {
+    if (now < evict_at) {
         return false;
     }
 
-    cache_list.erase(it->second);
-    cache_map.erase(it);
+    Erase(it->second, EvictionReason::Expired);
     min_heap.pop();
 
     return true;
@@ -107,15 +236,4 @@ void CacheSpace::Cache::LogEvent(const std::string &url, bool hit) {
     } else {
         IncrementMisses(url);
     }
-}
-
-std::string CacheSpace::Cache::GetVarySpec(const std::string& path) const {
-    std::shared_lock lock(mtx);
-    auto it = vary_specs.find(path);
-    return it != vary_specs.end() ? it->second : "";
-}
-
-void CacheSpace::Cache::SetVarySpec(const std::string& path, const std::string& vary) {
-    std::unique_lock lock(mtx);
-    vary_specs[path] = vary;
 }
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "CacheControl.hpp"
+#include <charconv>
+#include <algorithm>
+
+namespace {
+    // RFC 9111 section 1.2.2: delta-seconds too large to represent are treated as 2^31.
+    constexpr int64_t DELTA_SECONDS_MAX = int64_t{1} << 31;
+
+    bool IsSpace(char c) {
+        return c == ' ' || c == '\t';
+    }
+
+    char ToLower(char c) {
+        return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+
+    bool NameIs(std::string_view name, std::string_view lower) {
+        if (name.size() != lower.size()) {
+            return false;
+        }
+
+        for (size_t i = 0; i < name.size(); i++) {
+            if (ToLower(name[i]) != lower[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::optional<int64_t> ParseDeltaSeconds(std::string_view value) {
+        int64_t seconds = 0;
+        auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), seconds);
+
+        if (ec == std::errc::result_out_of_range) {
+            return DELTA_SECONDS_MAX;
+        }
+
+        if (ec != std::errc{} || ptr != value.data() + value.size() || seconds < 0) {
+            return std::nullopt;
+        }
+
+        return std::min(seconds, DELTA_SECONDS_MAX);
+    }
+
+    void SetOnce(std::optional<int64_t> &field, std::string_view value) {
+        if (!field) {
+            field = ParseDeltaSeconds(value);
+        }
+    }
+}
+
+ProxySpace::CacheControl ProxySpace::ParseCacheControl(std::string_view header) {
+    CacheControl result;
+    size_t i = 0;
+
+    while (i < header.size()) {
+        while (i < header.size() && (IsSpace(header[i]) || header[i] == ',')) {
+            i++;
+        }
+
+        size_t name_start = i;
+
+        while (i < header.size() && header[i] != '=' && header[i] != ',' && !IsSpace(header[i])) {
+            i++;
+        }
+
+        std::string_view name = header.substr(name_start, i - name_start);
+        std::string_view value;
+
+        while (i < header.size() && IsSpace(header[i])) {
+            i++;
+        }
+
+        if (i < header.size() && header[i] == '=') {
+            i++;
+
+            while (i < header.size() && IsSpace(header[i])) {
+                i++;
+            }
+
+            if (i < header.size() && header[i] == '"') {
+                // Quoted-string, e.g. private="Set-Cookie" or max-age="60".
+                size_t value_start = ++i;
+
+                while (i < header.size() && header[i] != '"') {
+                    i += header[i] == '\\' ? 2 : 1;
+                }
+
+                value = header.substr(value_start, std::min(i, header.size()) - value_start);
+                i++;
+            } else {
+                size_t value_start = i;
+
+                while (i < header.size() && header[i] != ',' && !IsSpace(header[i])) {
+                    i++;
+                }
+
+                value = header.substr(value_start, i - value_start);
+            }
+        }
+
+        // Skip anything else up to the next directive.
+        while (i < header.size() && header[i] != ',') {
+            i++;
+        }
+
+        if (name.empty()) {
+            continue;
+        }
+
+        if (NameIs(name, "max-age")) {
+            SetOnce(result.max_age, value);
+        } else if (NameIs(name, "s-maxage")) {
+            SetOnce(result.s_maxage, value);
+        } else if (NameIs(name, "stale-while-revalidate")) {
+            SetOnce(result.stale_while_revalidate, value);
+        } else if (NameIs(name, "stale-if-error")) {
+            SetOnce(result.stale_if_error, value);
+        } else if (NameIs(name, "no-store")) {
+            result.no_store = true;
+        } else if (NameIs(name, "no-cache")) {
+            result.no_cache = true;
+        } else if (NameIs(name, "private")) {
+            result.is_private = true;
+        } else if (NameIs(name, "public")) {
+            result.is_public = true;
+        } else if (NameIs(name, "must-revalidate")) {
+            result.must_revalidate = true;
+        } else if (NameIs(name, "proxy-revalidate")) {
+            result.proxy_revalidate = true;
+        } else if (NameIs(name, "immutable")) {
+            result.immutable = true;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,32 @@
+#include "Clock.hpp"
+#include <chrono>
+
+CacheSpace::CoarseClock::CoarseClock() : now_ms(PreciseMillis()) {
+    ticker = std::thread(&CacheSpace::CoarseClock::TickerFunction, this);
+}
+
+CacheSpace::CoarseClock::~CoarseClock() {
+    is_running = false;
+
+    if (ticker.joinable()) {
+        ticker.join();
+    }
+}
+
+CacheSpace::CoarseClock& CacheSpace::CoarseClock::Instance() {
+    static CoarseClock clock;
+    return clock;
+}
+
+int64_t CacheSpace::CoarseClock::PreciseMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+void CacheSpace::CoarseClock::TickerFunction() {
+    while (is_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(TICK_MS));
+        now_ms.store(PreciseMillis(), std::memory_order_relaxed);
+    }
+}
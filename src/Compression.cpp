@@ -0,0 +1,159 @@
+#include "Compression.hpp"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <zlib.h>
+
+namespace {
+    constexpr int GZIP_WINDOW_BITS = 15 + 16; // +16 selects the gzip wrapper instead of zlib's
+    constexpr size_t CHUNK_SIZE = 16 * 1024;
+
+    std::string_view Trim(std::string_view s) {
+        size_t start = s.find_first_not_of(" \t");
+
+        if (start == std::string_view::npos) {
+            return {};
+        }
+
+        return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+    }
+
+    bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+        });
+    }
+}
+
+std::optional<std::string> CacheSpace::GzipCompress(std::string_view input, int level) {
+    z_stream stream{};
+
+    if (deflateInit2(&stream, level, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return std::nullopt;
+    }
+
+    std::string output;
+    output.resize(deflateBound(&stream, static_cast<uLong>(input.size())));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = reinterpret_cast<Bytef*>(output.data());
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    if (result != Z_STREAM_END) {
+        return std::nullopt;
+    }
+
+    return output;
+}
+
+std::optional<std::string> CacheSpace::GzipDecompress(std::string_view input, size_t max_size) {
+    z_stream stream{};
+
+    if (inflateInit2(&stream, GZIP_WINDOW_BITS) != Z_OK) {
+        return std::nullopt;
+    }
+
+    std::string output;
+    std::array<char, CHUNK_SIZE> buffer;
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    int result = Z_OK;
+
+    while (result == Z_OK) {
+        stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+        stream.avail_out = static_cast<uInt>(buffer.size());
+        result = inflate(&stream, Z_NO_FLUSH);
+
+        if (result != Z_OK && result != Z_STREAM_END) {
+            break;
+        }
+
+        output.append(buffer.data(), buffer.size() - stream.avail_out);
+
+        if (output.size() > max_size) {
+            result = Z_BUF_ERROR;
+            break;
+        }
+    }
+
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END) {
+        return std::nullopt;
+    }
+
+    return output;
+}
+
+bool CacheSpace::IsCompressibleType(std::string_view content_type) {
+    content_type = Trim(content_type.substr(0, content_type.find(';')));
+
+    if (content_type.starts_with("text/")) {
+        return true;
+    }
+
+    static constexpr std::array<std::string_view, 6> compressible = {
+        "application/json", "application/javascript", "application/xml",
+        "application/xhtml+xml", "image/svg+xml", "application/wasm",
+    };
+
+    return std::ranges::any_of(compressible, [&](std::string_view type) { return EqualsIgnoreCase(type, content_type); })
+        || content_type.ends_with("+json") || content_type.ends_with("+xml");
+}
+
+std::string CacheSpace::EncodingETag(std::string_view etag, std::string_view coding) {
+    std::string tagged(etag);
+    size_t insert_at = etag.size() >= 2 && etag.back() == '"' ? etag.size() - 1 : etag.size();
+    tagged.insert(insert_at, "-" + std::string(coding));
+
+    return tagged;
+}
+
+bool CacheSpace::AcceptsEncoding(const httplib::Request &req, std::string_view coding) {
+    auto it = req.headers.find("Accept-Encoding");
+
+    if (it == req.headers.end()) {
+        return false;
+    }
+
+    // An entry naming the coding decides over *, wherever either appears in the list.
+    std::optional<bool> named;
+    std::optional<bool> wildcard;
+    std::string_view rest = it->second;
+
+    while (!rest.empty()) {
+        size_t comma = rest.find(',');
+        std::string_view item = Trim(rest.substr(0, comma));
+        rest = comma == std::string_view::npos ? std::string_view{} : rest.substr(comma + 1);
+
+        size_t semicolon = item.find(';');
+        std::string_view name = Trim(item.substr(0, semicolon));
+        bool is_named = EqualsIgnoreCase(name, coding);
+
+        if (!is_named && name != "*") {
+            continue;
+        }
+
+        // Only an explicit q=0 (or 0.000) rules the coding out.
+        double q = 1.0;
+        std::string_view params = semicolon == std::string_view::npos ? std::string_view{} : item.substr(semicolon + 1);
+
+        while (!params.empty()) {
+            size_t next = params.find(';');
+            std::string_view param = Trim(params.substr(0, next));
+            params = next == std::string_view::npos ? std::string_view{} : params.substr(next + 1);
+
+            if (param.starts_with("q=") || param.starts_with("Q=")) {
+                std::from_chars(param.data() + 2, param.data() + param.size(), q);
+            }
+        }
+
+        (is_named ? named : wildcard) = q > 0.0;
+    }
+
+    return named.value_or(wildcard.value_or(false));
+}
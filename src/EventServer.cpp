@@ -0,0 +1,1049 @@
+#include "EventServer.hpp"
+
+#ifdef __linux__
+
+#include "Clock.hpp"
+#include "Logger.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <future>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+    constexpr size_t MAX_HEAD_SIZE = 64 * 1024; // request line and headers
+    constexpr size_t READ_SIZE = 16 * 1024;
+    constexpr size_t HIGH_WATER = 1024 * 1024; // response bytes a worker may buffer ahead of the socket
+    constexpr size_t LOW_WATER = 256 * 1024;
+    constexpr size_t KEEP_CAPACITY = 64 * 1024; // larger buffers are freed once empty
+    constexpr int64_t IDLE_TIMEOUT_MS = 60 * 1000;
+    constexpr int SWEEP_INTERVAL_MS = 1000;
+    constexpr int MAX_EVENTS = 256;
+
+    std::atomic<size_t> configured_loops{0};
+}
+
+namespace ProxySpace {
+    // What epoll_event.data.ptr points at.
+    struct EventSource {
+        enum class Kind { Wake, Listener, Connection };
+        Kind kind;
+    };
+
+    struct Listener : EventSource {
+        int fd{-1};
+        EventServer* server{nullptr};
+        EventLoop* loop{nullptr};
+        bool backlogged{false}; // accept ran out of descriptors; retried on the next sweep
+    };
+
+    struct Connection : EventSource, std::enable_shared_from_this<Connection> {
+        int fd{-1};
+        EventServer* server{nullptr};
+        EventLoop* loop{nullptr};
+        std::string remote_addr;
+        int remote_port{0};
+
+        // Loop thread only.
+        std::string in;
+        size_t scanned{0}; // bytes of in already searched for the end of the head
+        int64_t last_active_ms{0};
+        bool busy{false}; // a worker is answering; later requests wait in in
+        bool read_paused{false}; // in is full; reading resumes once requests are taken from it
+        bool close_after_write{false};
+        bool removed{false};
+
+        // Shared with the worker answering the current request.
+        std::mutex mtx;
+        std::condition_variable drained_cv;
+        std::string out;
+        size_t out_offset{0};
+        bool closed{false};
+        bool flush_posted{false};
+    };
+
+    // A request and its response, kept together while a worker answers.
+    struct Exchange {
+        httplib::Request req;
+        httplib::Response res;
+    };
+
+    class EventLoop {
+    public:
+        EventLoop();
+        ~EventLoop();
+
+        // Runs fn on the loop thread.
+        void Post(std::function<void()> fn);
+
+        void AddListener(Listener*);
+        void RemoveServer(EventServer*, std::shared_ptr<std::promise<void>> done);
+        bool Flush(std::shared_ptr<Connection>);
+        void Finished(std::shared_ptr<Connection>, bool keep_alive);
+
+    private:
+        void Run();
+        void Accept(Listener&);
+        void Read(std::shared_ptr<Connection>);
+        bool CanResumeRead(Connection&);
+        void Process(const std::shared_ptr<Connection>&);
+        void Dispatch(const std::shared_ptr<Connection>&, std::shared_ptr<Exchange>, bool close_connection);
+        void WriteNow(const std::shared_ptr<Connection>&, Exchange&, bool close_connection);
+        void Reject(const std::shared_ptr<Connection>&, int status);
+        void Close(std::shared_ptr<Connection>);
+        void Sweep();
+
+        int epoll_fd{-1};
+        int wake_fd{-1};
+        EventSource wake{EventSource::Kind::Wake};
+        std::mutex posted_mtx;
+        std::vector<std::function<void()>> posted;
+        std::unordered_map<int, std::shared_ptr<Connection>> connections;
+        std::vector<Listener*> listeners;
+        std::vector<std::shared_ptr<Connection>> closed; // kept alive until the current batch of events is done
+        std::vector<std::function<void()>> after_batch;
+        int64_t next_sweep_ms{0};
+        std::atomic<bool> is_running{true};
+        std::thread thread;
+    };
+}
+
+namespace {
+    // Response bytes go to the connection's output buffer for the loop to send. A worker waits
+    // while the buffer is over HIGH_WATER; the loop thread never waits, as it does the sending.
+    class ConnectionStream : public httplib::Stream {
+    public:
+        ConnectionStream(ProxySpace::Connection& connection, bool from_worker) : connection(connection), from_worker(from_worker) {}
+
+        bool is_readable() const override { return false; }
+        bool wait_readable() const override { return false; }
+
+        bool wait_writable() const override {
+            std::lock_guard lock(connection.mtx);
+            return !connection.closed;
+        }
+
+        ssize_t read(char*, size_t) override { return -1; }
+        ssize_t write(const char* ptr, size_t size) override;
+        using httplib::Stream::write;
+
+        void get_remote_ip_and_port(std::string& ip, int& port) const override {
+            ip = connection.remote_addr;
+            port = connection.remote_port;
+        }
+
+        void get_local_ip_and_port(std::string& ip, int& port) const override {
+            ip.clear();
+            port = 0;
+        }
+
+        socket_t socket() const override { return connection.fd; }
+        time_t duration() const override { return 0; }
+
+    private:
+        ProxySpace::Connection& connection;
+        bool from_worker;
+    };
+
+    ssize_t ConnectionStream::write(const char* ptr, size_t size) {
+        std::unique_lock lock(connection.mtx);
+
+        if (from_worker) {
+            connection.drained_cv.wait(lock, [this] { return connection.closed || connection.out.size() - connection.out_offset < HIGH_WATER; });
+        }
+
+        if (connection.closed) {
+            return -1;
+        }
+
+        connection.out.append(ptr, size);
+
+        if (from_worker && !connection.flush_posted) {
+            connection.flush_posted = true;
+            lock.unlock();
+            connection.loop->Post([conn = connection.shared_from_this()] { conn->loop->Flush(conn); });
+        }
+
+        return static_cast<ssize_t>(size);
+    }
+
+    // Parses the request line and headers; head ends with the CRLF of the last header. Returns 0,
+    // or the status to reject the request with, as httplib::Server would.
+    int ParseHead(std::string_view head, httplib::Request& req) {
+        size_t line_end = head.find("\r\n");
+        std::string_view line = head.substr(0, line_end);
+        size_t first = line.find(' ');
+        size_t second = first == std::string_view::npos ? first : line.find(' ', first + 1);
+
+        if (second == std::string_view::npos || line.find(' ', second + 1) != std::string_view::npos) {
+            return httplib::StatusCode::BadRequest_400;
+        }
+
+        req.method = line.substr(0, first);
+        req.target = line.substr(first + 1, second - first - 1);
+        req.version = line.substr(second + 1);
+
+        static const std::array<std::string_view, 9> methods = {"GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH"};
+
+        if (std::find(methods.begin(), methods.end(), req.method) == methods.end() || (req.version != "HTTP/1.1" && req.version != "HTTP/1.0")) {
+            return httplib::StatusCode::BadRequest_400;
+        }
+
+        if (req.target.size() > CPPHTTPLIB_REQUEST_URI_MAX_LENGTH) {
+            return httplib::StatusCode::UriTooLong_414;
+        }
+
+        req.target.erase(std::min(req.target.find('#'), req.target.size()));
+        size_t query = req.target.find('?');
+        req.path = httplib::decode_path_component(req.target.substr(0, query));
+
+        if (query != std::string::npos) {
+            httplib::detail::parse_query_text(req.target.data() + query + 1, req.target.size() - query - 1, req.params);
+        }
+
+        size_t count = 0;
+
+        for (size_t pos = line_end + 2; pos < head.size();) {
+            size_t end = head.find("\r\n", pos);
+            bool parsed = httplib::detail::parse_header(head.data() + pos, head.data() + end, [&req](const std::string& key, const std::string& value) {
+                req.headers.emplace(key, value);
+            });
+
+            if (!parsed || ++count > CPPHTTPLIB_HEADER_MAX_COUNT) {
+                return httplib::StatusCode::BadRequest_400;
+            }
+
+            pos = end + 2;
+        }
+
+        if (req.has_header("Accept") && !httplib::detail::parse_accept_header(req.get_header_value("Accept"), req.accept_content_types)) {
+            return httplib::StatusCode::BadRequest_400;
+        }
+
+        if (req.has_header("Range") && !httplib::detail::parse_range_header(req.get_header_value("Range"), req.ranges)) {
+            return httplib::StatusCode::RangeNotSatisfiable_416;
+        }
+
+        return 0;
+    }
+
+    // httplib::Server::write_response_core and apply_ranges are private, so this follows them,
+    // less response compression, which the proxy does not use. False if the connection went
+    // away; close_connection comes back true if it must be closed after this response.
+    bool WriteResponse(httplib::Stream& strm, httplib::Request& req, httplib::Response& res, bool& close_connection) {
+        namespace detail = httplib::detail;
+
+        if (res.status == -1) {
+            res.status = req.ranges.empty() ? httplib::StatusCode::OK_200 : httplib::StatusCode::PartialContent_206;
+        }
+
+        if (detail::range_error(req, res)) {
+            res.body.clear();
+            res.content_length_ = 0;
+            res.content_provider_ = nullptr;
+            res.status = httplib::StatusCode::RangeNotSatisfiable_416;
+            req.ranges.clear();
+        }
+
+        bool partial = !req.ranges.empty() && res.status == httplib::StatusCode::PartialContent_206;
+        std::string content_type;
+        std::string boundary;
+
+        if (partial && req.ranges.size() > 1) {
+            auto it = res.headers.find("Content-Type");
+
+            if (it != res.headers.end()) {
+                content_type = it->second;
+                res.headers.erase(it);
+            }
+
+            boundary = detail::make_multipart_data_boundary();
+            res.set_header("Content-Type", "multipart/byteranges; boundary=" + boundary);
+        }
+
+        if (!res.body.empty()) {
+            if (partial && req.ranges.size() == 1) {
+                auto range = detail::get_range_offset_and_length(req.ranges[0], res.body.size());
+                res.set_header("Content-Range", detail::make_content_range_header_field(range, res.body.size()));
+                res.body = res.body.substr(range.first, range.second);
+            } else if (partial) {
+                std::string data;
+                detail::make_multipart_ranges_data(req, res, boundary, content_type, res.body.size(), data);
+                res.body.swap(data);
+            }
+
+            res.set_header("Content-Length", std::to_string(res.body.size()));
+        } else if (res.content_length_ > 0) {
+            size_t length = res.content_length_;
+
+            if (partial && req.ranges.size() == 1) {
+                auto range = detail::get_range_offset_and_length(req.ranges[0], res.content_length_);
+                length = range.second;
+                res.set_header("Content-Range", detail::make_content_range_header_field(range, res.content_length_));
+            } else if (partial) {
+                length = detail::get_multipart_ranges_data_length(req, boundary, content_type, res.content_length_);
+            }
+
+            res.set_header("Content-Length", std::to_string(length));
+        } else if (res.content_provider_ && res.is_chunked_content_provider_) {
+            res.set_header("Transfer-Encoding", "chunked");
+        }
+
+        // Without a length or chunking, the end of the body is the end of the connection.
+        bool until_close = res.body.empty() && res.content_length_ == 0 && res.content_provider_ && !res.is_chunked_content_provider_;
+
+        // Errors close the connection, as with httplib.
+        if (close_connection || until_close || res.status >= 400) {
+            close_connection = true;
+            res.set_header("Connection", "close");
+        } else {
+            res.set_header("Keep-Alive", "timeout=" + std::to_string(IDLE_TIMEOUT_MS / 1000));
+        }
+
+        if ((!res.body.empty() || res.content_length_ > 0 || res.content_provider_) && !res.has_header("Content-Type")) {
+            res.set_header("Content-Type", "text/plain");
+        }
+
+        if (res.body.empty() && res.content_length_ == 0 && !res.content_provider_ && !res.has_header("Content-Length")) {
+            res.set_header("Content-Length", "0");
+        }
+
+        if (req.method == "HEAD" && !res.has_header("Accept-Ranges")) {
+            res.set_header("Accept-Ranges", "bytes");
+        }
+
+        detail::BufferStream head;
+        detail::write_response_line(head, res.status);
+        detail::write_headers(head, res.headers);
+
+        if (!detail::write_data(strm, head.get_buffer().data(), head.get_buffer().size())) {
+            return false;
+        }
+
+        if (req.method == "HEAD") {
+            return true;
+        }
+
+        if (!res.body.empty()) {
+            return detail::write_data(strm, res.body.data(), res.body.size());
+        }
+
+        if (!res.content_provider_) {
+            return true;
+        }
+
+        auto is_closed = [&strm] { return !strm.wait_writable(); };
+        bool ok;
+
+        if (res.content_length_ > 0 && !partial) {
+            ok = detail::write_content(strm, res.content_provider_, 0, res.content_length_, is_closed);
+        } else if (res.content_length_ > 0 && req.ranges.size() == 1) {
+            auto range = detail::get_range_offset_and_length(req.ranges[0], res.content_length_);
+            ok = detail::write_content(strm, res.content_provider_, range.first, range.second, is_closed);
+        } else if (res.content_length_ > 0) {
+            ok = detail::write_multipart_ranges_data(strm, req, res, boundary, content_type, res.content_length_, is_closed);
+        } else if (res.is_chunked_content_provider_) {
+            detail::nocompressor compressor;
+            ok = detail::write_content_chunked(strm, res.content_provider_, is_closed, compressor);
+        } else {
+            ok = detail::write_content_without_length(strm, res.content_provider_, is_closed);
+        }
+
+        res.content_provider_success_ = ok;
+        return ok;
+    }
+
+    void Release(std::string& buffer) {
+        if (buffer.capacity() > KEEP_CAPACITY) {
+            std::string().swap(buffer);
+        }
+    }
+
+    // Created on first use, so Configure can run first.
+    std::vector<std::unique_ptr<ProxySpace::EventLoop>>& Loops() {
+        static std::vector<std::unique_ptr<ProxySpace::EventLoop>> loops = [] {
+            size_t count = configured_loops.load() > 0 ? configured_loops.load() : std::max(std::thread::hardware_concurrency(), 1u);
+            std::vector<std::unique_ptr<ProxySpace::EventLoop>> created;
+
+            for (size_t i = 0; i < count; i++) {
+                created.push_back(std::make_unique<ProxySpace::EventLoop>());
+            }
+
+            return created;
+        }();
+
+        return loops;
+    }
+}
+
+ProxySpace::EventLoop::EventLoop() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = &wake;
+
+    if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0) {
+        throw std::runtime_error("Could not create an event loop!");
+    }
+
+    thread = std::thread(&ProxySpace::EventLoop::Run, this);
+}
+
+ProxySpace::EventLoop::~EventLoop() {
+    is_running = false;
+    Post([] {});
+
+    if (thread.joinable()) {
+        thread.join();
+    }
+
+    for (auto& [fd, conn] : connections) {
+        ::close(fd);
+    }
+
+    ::close(wake_fd);
+    ::close(epoll_fd);
+}
+
+void ProxySpace::EventLoop::Post(std::function<void()> fn) {
+    bool was_empty;
+
+    {
+        std::lock_guard lock(posted_mtx);
+        was_empty = posted.empty();
+        posted.push_back(std::move(fn));
+    }
+
+    // A non-empty list has a wake-up on the way already.
+    if (was_empty) {
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t written = ::write(wake_fd, &one, sizeof(one));
+    }
+}
+
+// The listening socket is shared by all loops; EPOLLEXCLUSIVE wakes one of them per new
+// connection instead of all, and the one woken accepts until the queue is empty.
+void ProxySpace::EventLoop::AddListener(Listener* listener) {
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    event.data.ptr = static_cast<EventSource*>(listener);
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener->fd, &event) != 0) {
+        Logger::Log(LogLevel::Error, listener->server->group->Port(), "Could not watch the listening socket!");
+        return;
+    }
+
+    listeners.push_back(listener);
+}
+
+void ProxySpace::EventLoop::RemoveServer(EventServer* server, std::shared_ptr<std::promise<void>> done) {
+    for (auto it = listeners.begin(); it != listeners.end();) {
+        if ((*it)->server != server) {
+            ++it;
+            continue;
+        }
+
+        // The socket is shared with the other loops; Stop closes it once they all let go.
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, (*it)->fd, nullptr);
+        it = listeners.erase(it);
+    }
+
+    std::vector<std::shared_ptr<Connection>> owned;
+
+    for (auto& [fd, conn] : connections) {
+        if (conn->server == server) {
+            owned.push_back(conn);
+        }
+    }
+
+    for (auto& conn : owned) {
+        Close(conn);
+    }
+
+    // Events for the listeners may still be in the current batch, and they are freed once Stop returns.
+    after_batch.push_back([done] { done->set_value(); });
+}
+
+void ProxySpace::EventLoop::Run() {
+    std::array<epoll_event, MAX_EVENTS> events;
+
+    while (is_running) {
+        int count = epoll_wait(epoll_fd, events.data(), MAX_EVENTS, SWEEP_INTERVAL_MS);
+
+        for (int i = 0; i < count; i++) {
+            auto* source = static_cast<EventSource*>(events[i].data.ptr);
+            uint32_t flags = events[i].events;
+
+            if (source->kind == EventSource::Kind::Wake) {
+                uint64_t value;
+                [[maybe_unused]] ssize_t read = ::read(wake_fd, &value, sizeof(value));
+                std::vector<std::function<void()>> batch;
+
+                {
+                    std::lock_guard lock(posted_mtx);
+                    batch.swap(posted);
+                }
+
+                for (auto& fn : batch) {
+                    fn();
+                }
+            } else if (source->kind == EventSource::Kind::Listener) {
+                Accept(*static_cast<Listener*>(source));
+            } else {
+                auto conn = static_cast<Connection*>(source)->shared_from_this();
+
+                if (conn->removed) {
+                    continue;
+                }
+
+                if (flags & EPOLLERR) {
+                    Close(conn);
+                    continue;
+                }
+
+                if ((flags & EPOLLOUT) && !Flush(conn)) {
+                    continue;
+                }
+
+                if ((flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) || ((flags & EPOLLOUT) && CanResumeRead(*conn))) {
+                    Read(conn);
+                }
+            }
+        }
+
+        if (CacheSpace::CoarseClock::NowMillis() >= next_sweep_ms) {
+            Sweep();
+        }
+
+        closed.clear();
+
+        for (auto& fn : after_batch) {
+            fn();
+        }
+
+        after_batch.clear();
+    }
+}
+
+void ProxySpace::EventLoop::Accept(Listener& listener) {
+    bool was_backlogged = listener.backlogged;
+    listener.backlogged = false;
+
+    while (true) {
+        sockaddr_storage address{};
+        socklen_t length = sizeof(address);
+        int fd = accept4(listener.fd, reinterpret_cast<sockaddr*>(&address), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            // Out of descriptors: the rest wait in the backlog until the next sweep, as an
+            // edge-triggered listener is not reported again until another connection arrives.
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                listener.backlogged = true;
+            }
+
+            if (listener.backlogged && !was_backlogged) {
+                Logger::Log(LogLevel::Warn, listener.server->group->Port(), "Out of file descriptors; accepting again in a second");
+            }
+
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto conn = std::make_shared<Connection>();
+        conn->kind = EventSource::Kind::Connection;
+        conn->fd = fd;
+        conn->server = listener.server;
+        conn->loop = this;
+        conn->last_active_ms = CacheSpace::CoarseClock::NowMillis();
+
+        char host[NI_MAXHOST];
+
+        if (getnameinfo(reinterpret_cast<sockaddr*>(&address), length, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) == 0) {
+            conn->remote_addr = host;
+        }
+
+        if (address.ss_family == AF_INET) {
+            conn->remote_port = ntohs(reinterpret_cast<sockaddr_in*>(&address)->sin_port);
+        } else if (address.ss_family == AF_INET6) {
+            conn->remote_port = ntohs(reinterpret_cast<sockaddr_in6*>(&address)->sin6_port);
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = static_cast<EventSource*>(conn.get());
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            ::close(fd);
+            continue;
+        }
+
+        listener.server->connections.fetch_add(1, std::memory_order_relaxed);
+        connections.emplace(fd, std::move(conn));
+    }
+}
+
+// Edge-triggered, so reads until the socket is drained. Requests answered inline leave no
+// Finished behind to resume a paused read, so it goes round again once they have made room in
+// in, unless their responses are piling up unsent; the socket turning writable resumes it then.
+void ProxySpace::EventLoop::Read(std::shared_ptr<Connection> conn) {
+    size_t limit = MAX_HEAD_SIZE + conn->server->max_payload + READ_SIZE;
+    bool peer_closed = false;
+
+    do {
+        conn->read_paused = false;
+
+        while (true) {
+            // Pipelined requests queue up behind a busy one until in is full.
+            if (conn->in.size() >= limit) {
+                conn->read_paused = true;
+                break;
+            }
+
+            char buffer[READ_SIZE];
+            ssize_t n = ::recv(conn->fd, buffer, sizeof(buffer), 0);
+
+            if (n > 0) {
+                conn->in.append(buffer, n);
+                continue;
+            }
+
+            if (n == 0) {
+                peer_closed = true;
+                break;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+
+            Close(conn);
+            return;
+        }
+
+        conn->last_active_ms = CacheSpace::CoarseClock::NowMillis();
+        Process(conn);
+
+        // What was received is still answered.
+        if (peer_closed) {
+            conn->close_after_write = true;
+        }
+
+        if (!Flush(conn)) {
+            return;
+        }
+    } while (CanResumeRead(*conn) && conn->in.size() < limit);
+}
+
+// Takes whole requests off in while no worker is answering one.
+void ProxySpace::EventLoop::Process(const std::shared_ptr<Connection>& conn) {
+    while (!conn->busy && !conn->close_after_write && !conn->removed) {
+        size_t end = conn->in.find("\r\n\r\n", conn->scanned > 3 ? conn->scanned - 3 : 0);
+
+        if (end == std::string::npos) {
+            conn->scanned = conn->in.size();
+
+            if (conn->in.size() > MAX_HEAD_SIZE) {
+                Reject(conn, httplib::StatusCode::RequestHeaderFieldsTooLarge_431);
+            }
+
+            break;
+        }
+
+        if (end > MAX_HEAD_SIZE) {
+            Reject(conn, httplib::StatusCode::RequestHeaderFieldsTooLarge_431);
+            break;
+        }
+
+        auto exchange = std::make_shared<Exchange>();
+        httplib::Request& req = exchange->req;
+        int status = ParseHead(std::string_view(conn->in).substr(0, end + 2), req);
+
+        if (status != 0) {
+            Reject(conn, status);
+            break;
+        }
+
+        if (req.has_header("Transfer-Encoding")) {
+            Reject(conn, httplib::StatusCode::NotImplemented_501);
+            break;
+        }
+
+        size_t body_size = 0;
+
+        if (req.has_header("Content-Length")) {
+            std::string value = req.get_header_value("Content-Length");
+            auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), body_size);
+
+            if (ec != std::errc{} || ptr != value.data() + value.size()) {
+                Reject(conn, httplib::StatusCode::BadRequest_400);
+                break;
+            }
+
+            if (body_size > conn->server->max_payload) {
+                Reject(conn, httplib::StatusCode::PayloadTooLarge_413);
+                break;
+            }
+        }
+
+        size_t head_size = end + 4;
+
+        // The head is parsed again once the whole body is in.
+        if (conn->in.size() < head_size + body_size) {
+            conn->scanned = end;
+            break;
+        }
+
+        req.body.assign(conn->in, head_size, body_size);
+        conn->in.erase(0, head_size + body_size);
+        conn->scanned = 0;
+
+        std::string connection = req.get_header_value("Connection");
+        bool close_connection = connection == "close" || (req.version == "HTTP/1.0" && connection != "Keep-Alive");
+        Dispatch(conn, std::move(exchange), close_connection);
+    }
+
+    if (conn->in.empty()) {
+        Release(conn->in);
+    }
+}
+
+void ProxySpace::EventLoop::Dispatch(const std::shared_ptr<Connection>& conn, std::shared_ptr<Exchange> exchange, bool close_connection) {
+    httplib::Request& req = exchange->req;
+    httplib::Response& res = exchange->res;
+    req.remote_addr = conn->remote_addr;
+    req.remote_port = conn->remote_port;
+    res.version = "HTTP/1.1";
+
+    // The proxy only routes GET, and HEAD with it; anything else is not found, as with httplib.
+    if (req.method != "GET" && req.method != "HEAD") {
+        res.status = httplib::StatusCode::NotFound_404;
+        WriteNow(conn, *exchange, close_connection);
+        return;
+    }
+
+    EventServer::Deferred deferred;
+
+    try {
+        deferred = conn->server->handler(req, res);
+    } catch (const std::exception& e) {
+        Logger::Log(LogLevel::Error, conn->server->group->Port(), std::string("Request failed: ") + e.what());
+        res = httplib::Response();
+        res.status = httplib::StatusCode::InternalServerError_500;
+    }
+
+    if (!deferred) {
+        WriteNow(conn, *exchange, close_connection);
+        return;
+    }
+
+    conn->busy = true;
+
+    bool submitted = conn->server->group->Submit([conn, exchange, deferred = std::move(deferred), close_connection]() mutable {
+        httplib::Request& req = exchange->req;
+        httplib::Response& res = exchange->res;
+
+        try {
+            deferred(req, res);
+        } catch (const std::exception& e) {
+            Logger::Log(LogLevel::Error, conn->server->group->Port(), std::string("Request failed: ") + e.what());
+            res = httplib::Response();
+            res.status = httplib::StatusCode::InternalServerError_500;
+        }
+
+        ConnectionStream stream(*conn, true);
+        bool written = WriteResponse(stream, req, res, close_connection);
+        bool keep_alive = written && !close_connection;
+        conn->loop->Post([conn, keep_alive] { conn->loop->Finished(conn, keep_alive); });
+    });
+
+    if (!submitted) {
+        conn->busy = false;
+        res = httplib::Response();
+        res.status = httplib::StatusCode::ServiceUnavailable_503;
+        WriteNow(conn, *exchange, true);
+    }
+}
+
+// Buffers the response; the caller flushes once it is done with the batch.
+void ProxySpace::EventLoop::WriteNow(const std::shared_ptr<Connection>& conn, Exchange& exchange, bool close_connection) {
+    ConnectionStream stream(*conn, false);
+
+    if (!WriteResponse(stream, exchange.req, exchange.res, close_connection) || close_connection) {
+        conn->close_after_write = true;
+    }
+}
+
+void ProxySpace::EventLoop::Reject(const std::shared_ptr<Connection>& conn, int status) {
+    Exchange exchange;
+    exchange.res.status = status;
+    WriteNow(conn, exchange, true);
+}
+
+void ProxySpace::EventLoop::Finished(std::shared_ptr<Connection> conn, bool keep_alive) {
+    if (conn->removed) {
+        return;
+    }
+
+    conn->busy = false;
+    conn->last_active_ms = CacheSpace::CoarseClock::NowMillis();
+
+    if (!keep_alive) {
+        conn->close_after_write = true;
+    }
+
+    // Requests that arrived while the worker was answering.
+    Process(conn);
+
+    if (Flush(conn) && CanResumeRead(*conn)) {
+        Read(conn);
+    }
+}
+
+// A paused read resumes once no worker is answering and the responses already written have
+// mostly reached the socket.
+bool ProxySpace::EventLoop::CanResumeRead(Connection& conn) {
+    if (!conn.read_paused || conn.busy || conn.close_after_write || conn.removed) {
+        return false;
+    }
+
+    std::lock_guard lock(conn.mtx);
+    return conn.out.size() - conn.out_offset < HIGH_WATER;
+}
+
+// Sends what the socket takes. False if the connection is closed.
+bool ProxySpace::EventLoop::Flush(std::shared_ptr<Connection> conn) {
+    if (conn->removed) {
+        return false;
+    }
+
+    bool failed = false;
+    size_t buffered;
+
+    {
+        std::lock_guard lock(conn->mtx);
+        conn->flush_posted = false;
+        size_t before = conn->out_offset;
+
+        while (conn->out_offset < conn->out.size()) {
+            ssize_t n = ::send(conn->fd, conn->out.data() + conn->out_offset, conn->out.size() - conn->out_offset, MSG_NOSIGNAL);
+
+            if (n > 0) {
+                conn->out_offset += n;
+                continue;
+            }
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            failed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+
+        if (conn->out_offset > before) {
+            conn->last_active_ms = CacheSpace::CoarseClock::NowMillis();
+        }
+
+        buffered = conn->out.size() - conn->out_offset;
+
+        if (buffered == 0) {
+            conn->out.clear();
+            conn->out_offset = 0;
+            Release(conn->out);
+        } else if (conn->out_offset >= buffered) {
+            conn->out.erase(0, conn->out_offset);
+            conn->out_offset = 0;
+        }
+    }
+
+    if (buffered <= LOW_WATER) {
+        conn->drained_cv.notify_all();
+    }
+
+    if (failed || (buffered == 0 && conn->close_after_write && !conn->busy)) {
+        Close(conn);
+        return false;
+    }
+
+    return true;
+}
+
+// Takes a copy of the pointer, as the map entry it may come from is erased here.
+void ProxySpace::EventLoop::Close(std::shared_ptr<Connection> conn) {
+    if (conn->removed) {
+        return;
+    }
+
+    conn->removed = true;
+
+    {
+        std::lock_guard lock(conn->mtx);
+        conn->closed = true;
+    }
+
+    // A worker waiting for the buffer to drain gives up.
+    conn->drained_cv.notify_all();
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    ::close(conn->fd);
+    conn->server->connections.fetch_sub(1, std::memory_order_relaxed);
+    connections.erase(conn->fd);
+    closed.push_back(std::move(conn));
+}
+
+// Closes idle connections and retries listeners that ran out of descriptors.
+void ProxySpace::EventLoop::Sweep() {
+    int64_t now = CacheSpace::CoarseClock::NowMillis();
+    next_sweep_ms = now + SWEEP_INTERVAL_MS;
+    std::vector<std::shared_ptr<Connection>> idle;
+
+    for (auto& [fd, conn] : connections) {
+        if (!conn->busy && now - conn->last_active_ms > IDLE_TIMEOUT_MS) {
+            idle.push_back(conn);
+        }
+    }
+
+    for (auto& conn : idle) {
+        Close(conn);
+    }
+
+    for (Listener* listener : listeners) {
+        if (listener->backlogged) {
+            Accept(*listener);
+        }
+    }
+}
+
+ProxySpace::EventServer::EventServer(std::shared_ptr<Runtime::Group> group, Handler handler, size_t max_payload) :
+    group(std::move(group)), handler(std::move(handler)), max_payload(max_payload) {}
+
+ProxySpace::EventServer::~EventServer() {
+    Stop();
+}
+
+void ProxySpace::EventServer::Configure(size_t loops) {
+    configured_loops = loops;
+}
+
+bool ProxySpace::EventServer::Listen(const std::string& host, int port) {
+    auto& loops = Loops();
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* results = nullptr;
+
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &results) != 0) {
+        return false;
+    }
+
+    // The first address that binds, as with httplib. Without SO_REUSEPORT, a port that another
+    // process (or a stale proxy) is listening on fails here rather than being shared with it.
+    int fd = -1;
+
+    for (addrinfo* address = results; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+        int one = 1;
+
+        if (fd < 0) {
+            continue;
+        }
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            bind(fd, address->ai_addr, address->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    // Every loop watches the one socket, see EventLoop::AddListener.
+    if (fd >= 0) {
+        listen_fd = fd;
+
+        for (auto& loop : loops) {
+            auto listener = std::make_unique<Listener>();
+            listener->kind = EventSource::Kind::Listener;
+            listener->fd = fd;
+            listener->server = this;
+            listener->loop = loop.get();
+            listeners.push_back(std::move(listener));
+        }
+    }
+
+    freeaddrinfo(results);
+
+    if (listeners.empty()) {
+        return false;
+    }
+
+    {
+        std::lock_guard lock(mtx);
+        is_listening = true;
+    }
+
+    for (auto& listener : listeners) {
+        Listener* added = listener.get();
+        added->loop->Post([added] { added->loop->AddListener(added); });
+    }
+
+    std::unique_lock lock(mtx);
+    stopped_cv.wait(lock, [this] { return !is_listening; });
+    return true;
+}
+
+// Closes the listeners and every connection of this server. Work already handed to workers
+// finishes, but its responses go nowhere.
+void ProxySpace::EventServer::Stop() {
+    {
+        std::lock_guard lock(mtx);
+
+        if (!is_listening) {
+            return;
+        }
+    }
+
+    std::vector<std::future<void>> removed;
+
+    for (auto& listener : listeners) {
+        auto done = std::make_shared<std::promise<void>>();
+        removed.push_back(done->get_future());
+        listener->loop->Post([loop = listener->loop, this, done] { loop->RemoveServer(this, done); });
+    }
+
+    for (auto& future : removed) {
+        future.wait();
+    }
+
+    ::close(listen_fd);
+    listen_fd = -1;
+
+    {
+        std::lock_guard lock(mtx);
+        is_listening = false;
+    }
+
+    stopped_cv.notify_all();
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include "Hash.hpp"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #include <nmmintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+    #define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    #include <arm_acle.h>
+    #define CRC32C_ARM 1
+#endif
+
+namespace {
+    constexpr uint32_t CRC32C_POLY = 0x82F63B78; // reflected Castagnoli polynomial
+
+    constexpr std::array<uint32_t, 256> MakeTable() {
+        std::array<uint32_t, 256> table{};
+
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            }
+
+            table[i] = crc;
+        }
+
+        return table;
+    }
+
+    constexpr std::array<uint32_t, 256> CRC32C_TABLE = MakeTable();
+
+    uint32_t Crc32cSoftware(const unsigned char* data, size_t length, uint32_t crc) {
+        for (size_t i = 0; i < length; i++) {
+            crc = CRC32C_TABLE[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+
+        return crc;
+    }
+
+#if defined(CRC32C_X86)
+    #if defined(__GNUC__) || defined(__clang__)
+    __attribute__((target("sse4.2")))
+    #endif
+    uint32_t Crc32cHardware(const unsigned char* data, size_t length, uint32_t crc) {
+        uint64_t crc64 = crc;
+
+        for (; length >= 8; data += 8, length -= 8) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            crc64 = _mm_crc32_u64(crc64, word);
+        }
+
+        crc = static_cast<uint32_t>(crc64);
+
+        for (; length > 0; data++, length--) {
+            crc = _mm_crc32_u8(crc, *data);
+        }
+
+        return crc;
+    }
+
+    bool HasHardwareCrc() {
+    #if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+    #else
+        return __builtin_cpu_supports("sse4.2");
+    #endif
+    }
+#elif defined(CRC32C_ARM)
+    uint32_t Crc32cHardware(const unsigned char* data, size_t length, uint32_t crc) {
+        for (; length >= 8; data += 8, length -= 8) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            crc = __crc32cd(crc, word);
+        }
+
+        for (; length > 0; data++, length--) {
+            crc = __crc32cb(crc, *data);
+        }
+
+        return crc;
+    }
+
+    bool HasHardwareCrc() { return true; }
+#endif
+}
+
+uint32_t CacheSpace::Crc32c(std::string_view data, uint32_t crc) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data.data());
+    crc = ~crc;
+
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    static const bool hardware = HasHardwareCrc();
+
+    if (hardware) {
+        return ~Crc32cHardware(bytes, data.size(), crc);
+    }
+#endif
+
+    return ~Crc32cSoftware(bytes, data.size(), crc);
+}
+
+std::string CacheSpace::SynthesizedETag(uint64_t hash) {
+    static constexpr char HEX[] = "0123456789abcdef";
+    std::string etag(18, '"');
+
+    for (int i = 0; i < 16; i++) {
+        etag[16 - i] = HEX[(hash >> (i * 4)) & 0xF];
+    }
+
+    return etag;
+}
@@ -0,0 +1,118 @@
+#include "HttpDate.hpp"
+#include <array>
+#include <charconv>
+
+namespace {
+    constexpr std::array<std::string_view, 12> MONTHS = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+    };
+
+    // Howard Hinnant's days_from_civil, so that no platform timegm() is needed.
+    int64_t DaysFromCivil(int64_t year, unsigned month, unsigned day) {
+        year -= month <= 2;
+        const int64_t era = (year >= 0 ? year : year - 399) / 400;
+        const unsigned year_of_era = static_cast<unsigned>(year - era * 400);
+        const unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        const unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+        return era * 146097 + static_cast<int64_t>(day_of_era) - 719468;
+    }
+
+    // Reads an unsigned decimal field and advances past it.
+    bool ReadNumber(std::string_view &s, int &out) {
+        while (!s.empty() && s.front() == ' ') {
+            s.remove_prefix(1);
+        }
+
+        auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+
+        if (ec != std::errc{} || out < 0) {
+            return false;
+        }
+
+        s.remove_prefix(ptr - s.data());
+        return true;
+    }
+
+    bool ReadMonth(std::string_view &s, unsigned &month) {
+        for (unsigned i = 0; i < MONTHS.size(); i++) {
+            if (s.starts_with(MONTHS[i])) {
+                month = i + 1;
+                s.remove_prefix(3);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool Skip(std::string_view &s, char c) {
+        if (s.empty() || s.front() != c) {
+            return false;
+        }
+
+        s.remove_prefix(1);
+        return true;
+    }
+
+    bool ReadTime(std::string_view &s, int &hour, int &minute, int &second) {
+        return ReadNumber(s, hour) && Skip(s, ':') && ReadNumber(s, minute) && Skip(s, ':') && ReadNumber(s, second)
+            && hour < 24 && minute < 60 && second <= 60;
+    }
+}
+
+std::optional<int64_t> ProxySpace::ParseHttpDate(std::string_view s) {
+    size_t comma = s.find(',');
+    int year = 0;
+    int day = 0;
+    int hour = 0;
+    int minute = 0;
+    int second = 0;
+    unsigned month = 0;
+
+    if (comma == std::string_view::npos) {
+        // asctime: "Sun Nov  6 08:49:37 1994"
+        if (s.size() < 4) {
+            return std::nullopt;
+        }
+
+        s.remove_prefix(4);
+
+        if (!ReadMonth(s, month) || !ReadNumber(s, day) || !Skip(s, ' ')
+            || !ReadTime(s, hour, minute, second) || !ReadNumber(s, year)) {
+            return std::nullopt;
+        }
+    } else {
+        s.remove_prefix(comma + 1);
+
+        if (!ReadNumber(s, day)) {
+            return std::nullopt;
+        }
+
+        if (Skip(s, '-')) {
+            // RFC 850: "Sunday, 06-Nov-94 08:49:37 GMT", two-digit years within 50 years of now.
+            if (!ReadMonth(s, month) || !Skip(s, '-') || !ReadNumber(s, year)) {
+                return std::nullopt;
+            }
+
+            if (year < 100) {
+                year += year < 70 ? 2000 : 1900;
+            }
+        } else {
+            // IMF-fixdate: "Sun, 06 Nov 1994 08:49:37 GMT"
+            if (!Skip(s, ' ') || !ReadMonth(s, month) || !ReadNumber(s, year)) {
+                return std::nullopt;
+            }
+        }
+
+        if (!Skip(s, ' ') || !ReadTime(s, hour, minute, second)) {
+            return std::nullopt;
+        }
+    }
+
+    if (day < 1 || day > 31) {
+        return std::nullopt;
+    }
+
+    return DaysFromCivil(year, month, static_cast<unsigned>(day)) * 86400 + hour * 3600 + minute * 60 + second;
+}
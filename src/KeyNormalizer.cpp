@@ -0,0 +1,145 @@
+#include "KeyNormalizer.hpp"
+#include <algorithm>
+
+namespace {
+    int HexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool IsUnreserved(unsigned char c) {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+            || c == '-' || c == '.' || c == '_' || c == '~';
+    }
+
+    // Decoding an unreserved character cannot change what the URL means; everything else keeps
+    // its escape, with the hex digits uppercased so that %2f and %2F compare equal.
+    void AppendDecoded(std::string& out, std::string_view in) {
+        for (size_t i = 0; i < in.size(); i++) {
+            int high = in[i] == '%' && i + 2 < in.size() ? HexValue(in[i + 1]) : -1;
+            int low = high >= 0 ? HexValue(in[i + 2]) : -1;
+
+            if (low < 0) {
+                out += in[i];
+                continue;
+            }
+
+            unsigned char decoded = static_cast<unsigned char>(high * 16 + low);
+
+            if (IsUnreserved(decoded)) {
+                out += static_cast<char>(decoded);
+            } else {
+                constexpr char HEX[] = "0123456789ABCDEF";
+                out += '%';
+                out += HEX[high];
+                out += HEX[low];
+            }
+
+            i += 2;
+        }
+    }
+
+    std::vector<std::string> Sorted(std::vector<std::string> names) {
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+}
+
+ProxySpace::KeyNormalizer::KeyNormalizer(bool sort_query, bool decode_percent, const std::vector<std::string>& drop_params, const std::vector<std::string>& allow_params)
+    : sort_query(sort_query), decode_percent(decode_percent), allow_names(Sorted(allow_params)) {
+    for (const auto& name : drop_params) {
+        if (!name.empty() && name.back() == '*') {
+            drop_prefixes.push_back(name.substr(0, name.size() - 1));
+        } else {
+            drop_names.push_back(name);
+        }
+    }
+
+    std::sort(drop_names.begin(), drop_names.end());
+    enabled = sort_query || decode_percent || !drop_params.empty() || !allow_params.empty();
+}
+
+bool ProxySpace::KeyNormalizer::KeepParam(std::string_view name) const {
+    if (!allow_names.empty() && !std::binary_search(allow_names.begin(), allow_names.end(), name, std::less<>{})) {
+        return false;
+    }
+
+    if (std::binary_search(drop_names.begin(), drop_names.end(), name, std::less<>{})) {
+        return false;
+    }
+
+    return std::none_of(drop_prefixes.begin(), drop_prefixes.end(), [&](const std::string& prefix) {
+        return name.starts_with(prefix);
+    });
+}
+
+std::string ProxySpace::KeyNormalizer::Normalize(std::string_view target) const {
+    if (target.empty()) {
+        return "/";
+    }
+
+    if (!enabled) {
+        return std::string(target);
+    }
+
+    // Scratch space is reused by each worker thread, so only the final key is allocated.
+    thread_local std::string decoded;
+    thread_local std::string key;
+    thread_local std::vector<std::string_view> params;
+    decoded.clear();
+    key.clear();
+    params.clear();
+
+    target = target.substr(0, target.find('#'));
+    size_t question = target.find('?');
+    std::string_view path = target.substr(0, question);
+    std::string_view query = question == std::string_view::npos ? std::string_view{} : target.substr(question + 1);
+
+    if (decode_percent) {
+        AppendDecoded(key, path);
+        AppendDecoded(decoded, query);
+        query = decoded;
+    } else {
+        key += path;
+    }
+
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        std::string_view param = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view{} : query.substr(amp + 1);
+
+        if (!param.empty() && KeepParam(param.substr(0, param.find('=')))) {
+            params.push_back(param);
+        }
+    }
+
+    // By name only, and stably: the order of a repeated parameter's values can mean something
+    // to the origin, so ?tag=z&tag=a and ?tag=a&tag=z stay different keys.
+    if (sort_query) {
+        std::stable_sort(params.begin(), params.end(), [](std::string_view a, std::string_view b) {
+            return a.substr(0, a.find('=')) < b.substr(0, b.find('='));
+        });
+    }
+
+    for (size_t i = 0; i < params.size(); i++) {
+        key += i == 0 ? '?' : '&';
+        key += params[i];
+    }
+
+    return key;
+}
+
+std::string ProxySpace::KeyNormalizer::DecodedPath(std::string_view target) {
+    size_t question = target.find('?');
+    std::string decoded;
+    decoded.reserve(target.size());
+    AppendDecoded(decoded, target.substr(0, question));
+
+    if (question != std::string_view::npos) {
+        decoded += target.substr(question);
+    }
+
+    return decoded;
+}
@@ -0,0 +1,175 @@
+#include "Logger.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+ProxySpace::Logger::Logger() {
+    writer = std::thread(&ProxySpace::Logger::WriterFunction, this);
+}
+
+ProxySpace::Logger::~Logger() {
+    is_running = false;
+
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+ProxySpace::Logger& ProxySpace::Logger::Instance() {
+    static Logger logger;
+    return logger;
+}
+
+std::optional<ProxySpace::LogLevel> ProxySpace::Logger::ParseLevel(std::string_view name) {
+    for (auto level : {LogLevel::Debug, LogLevel::Info, LogLevel::Warn, LogLevel::Error, LogLevel::Off}) {
+        if (LevelName(level) == name) {
+            return level;
+        }
+    }
+
+    return std::nullopt;
+}
+
+std::string_view ProxySpace::Logger::LevelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "debug";
+        case LogLevel::Info: return "info";
+        case LogLevel::Warn: return "warn";
+        case LogLevel::Error: return "error";
+        default: return "off";
+    }
+}
+
+// The ring is shared with the writer, so it outlives the thread that registered it. When the
+// thread exits, the ring is marked retired, and the writer hands it on to a new thread once it
+// has drained it, so threads coming and going do not pile up rings.
+ProxySpace::Logger::Ring& ProxySpace::Logger::LocalRing() {
+    struct Registration {
+        std::shared_ptr<Ring> ring;
+
+        ~Registration() {
+            ring->retired.store(true, std::memory_order_release);
+        }
+    };
+
+    thread_local Registration registration{[this] {
+        std::lock_guard lock(rings_mtx);
+        std::shared_ptr<Ring> ring;
+
+        if (free_rings.empty()) {
+            ring = std::make_shared<Ring>();
+        } else {
+            ring = std::move(free_rings.back());
+            free_rings.pop_back();
+            ring->retired.store(false, std::memory_order_relaxed);
+        }
+
+        rings.push_back(ring);
+        return ring;
+    }()};
+
+    return *registration.ring;
+}
+
+void ProxySpace::Logger::Log(LogLevel level, int port, std::string_view message) {
+    Logger& logger = Instance();
+
+    if (level < logger.level.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    Ring& ring = logger.LocalRing();
+    size_t head = ring.head.load(std::memory_order_relaxed);
+
+    if (head - ring.tail.load(std::memory_order_acquire) >= RING_SIZE) {
+        logger.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Record& record = ring.records[head & (RING_SIZE - 1)];
+    record.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count();
+    record.port = port;
+    record.level = level;
+    record.length = static_cast<uint16_t>(std::min(message.size(), MESSAGE_SIZE));
+    std::memcpy(record.message, message.data(), record.length);
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+// Formats whatever the rings hold into out.
+void ProxySpace::Logger::Drain(std::string& out) {
+    std::lock_guard lock(rings_mtx);
+
+    for (size_t i = 0; i < rings.size();) {
+        auto& ring = rings[i];
+
+        // Read before head: a retired ring's last record is then among those drained below.
+        bool retired = ring->retired.load(std::memory_order_acquire);
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            const Record& record = ring->records[tail & (RING_SIZE - 1)];
+            std::time_t seconds = record.time_ms / 1000;
+            std::tm utc;
+            gmtime_r(&seconds, &utc);
+            char prefix[64];
+            std::strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &utc);
+
+            out += prefix;
+            out += '.';
+            out += std::to_string(1000 + record.time_ms % 1000).substr(1);
+            out += "Z ";
+            out += LevelName(record.level);
+            out += " [PORT ";
+            out += std::to_string(record.port);
+            out += "] ";
+            out.append(record.message, record.length);
+            out += '\n';
+        }
+
+        ring->tail.store(tail, std::memory_order_release);
+
+        if (retired) {
+            free_rings.push_back(std::move(ring));
+            rings[i] = std::move(rings.back());
+            rings.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+void ProxySpace::Logger::WriterFunction() {
+    std::string buffer;
+    uint64_t reported_drops = 0;
+
+    while (true) {
+        bool running = is_running.load();
+        buffer.clear();
+        Drain(buffer);
+
+        uint64_t drops = dropped.load(std::memory_order_relaxed);
+
+        if (drops != reported_drops) {
+            buffer += "logger: dropped " + std::to_string(drops - reported_drops) + " records, the rings were full\n";
+            reported_drops = drops;
+        }
+
+        if (!buffer.empty()) {
+            std::fwrite(buffer.data(), 1, buffer.size(), stdout);
+            std::fflush(stdout);
+        }
+
+        // One last drain after shutdown was requested, then stop.
+        if (!running) {
+            break;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+    }
+}
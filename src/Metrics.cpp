@@ -0,0 +1,105 @@
+#include "Metrics.hpp"
+#include <charconv>
+
+size_t ProxySpace::ThreadShard() {
+    static std::atomic<size_t> next_shard{0};
+    thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+uint64_t ProxySpace::Counter::Value() const {
+    uint64_t total = 0;
+
+    for (const auto& shard : shards) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+
+    return total;
+}
+
+ProxySpace::Histogram::Snapshot ProxySpace::Histogram::Read() const {
+    Snapshot snapshot;
+
+    for (const auto& shard : shards) {
+        for (int i = 0; i < BUCKETS; i++) {
+            uint64_t count = shard.counts[i].load(std::memory_order_relaxed);
+            snapshot.counts[i] += count;
+            snapshot.count += count;
+        }
+
+        snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+    }
+
+    return snapshot;
+}
+
+void ProxySpace::AppendMetricHeader(std::string& out, std::string_view name, std::string_view type, std::string_view help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void ProxySpace::AppendMetric(std::string& out, std::string_view name, std::string_view labels, double value) {
+    char buffer[32];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+
+    out += name;
+
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+
+    out += ' ';
+    out.append(buffer, end);
+    out += '\n';
+}
+
+void ProxySpace::AppendHistogram(std::string& out, std::string_view name, std::string_view labels, const Histogram& histogram) {
+    Histogram::Snapshot snapshot = histogram.Read();
+
+    // Series appear once they have data, which keeps never-seen outcomes out of every scrape.
+    if (snapshot.count == 0) {
+        return;
+    }
+
+    std::string bucket_name = std::string(name) + "_bucket";
+    std::string prefix = labels.empty() ? "" : std::string(labels) + ",";
+    uint64_t cumulative = 0;
+
+    // The last bucket also holds everything slower than its bound, so only +Inf covers it.
+    for (int i = 0; i < Histogram::BUCKETS - 1; i++) {
+        cumulative += snapshot.counts[i];
+        char le[32];
+        auto [end, ec] = std::to_chars(le, le + sizeof(le), static_cast<double>(Histogram::BucketUpperBound(i)) / 1e6);
+        AppendMetric(out, bucket_name, prefix + "le=\"" + std::string(le, end) + "\"", static_cast<double>(cumulative));
+    }
+
+    AppendMetric(out, bucket_name, prefix + "le=\"+Inf\"", static_cast<double>(snapshot.count));
+    AppendMetric(out, std::string(name) + "_sum", labels, static_cast<double>(snapshot.sum) / 1e6);
+    AppendMetric(out, std::string(name) + "_count", labels, static_cast<double>(snapshot.count));
+}
+
+std::string ProxySpace::EscapeLabel(std::string_view value) {
+    std::string escaped;
+
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+
+    return escaped;
+}
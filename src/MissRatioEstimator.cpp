@@ -0,0 +1,74 @@
+#include "MissRatioEstimator.hpp"
+#include <algorithm>
+#include <cmath>
+
+CacheSpace::MissRatioEstimator::MissRatioEstimator(size_t capacity, size_t max_samples) : max_samples(std::max<size_t>(max_samples, 1)) {
+    Resize(capacity);
+}
+
+void CacheSpace::MissRatioEstimator::Resize(size_t new_capacity) {
+    capacity = std::max<size_t>(new_capacity, 1);
+    double largest = capacity * SCALES.back();
+    double rate = std::min(1.0, max_samples / largest);
+    threshold = std::max<uint64_t>(1, static_cast<uint64_t>(rate * SAMPLE_SPACE));
+    samples = 0;
+
+    for (size_t i = 0; i < SCALES.size(); i++) {
+        Ghost& ghost = ghosts[i];
+        ghost.capacity = std::max<size_t>(1, std::llround(capacity * SCALES[i] * rate));
+        ghost.lru.clear();
+        ghost.index.clear();
+        ghost.hits = 0;
+        ghost.accesses = 0;
+    }
+}
+
+void CacheSpace::MissRatioEstimator::Access(uint64_t hash) {
+    // The low bits pick the sample; the hash is mixed by the caller, so they are uniform.
+    if ((hash & (SAMPLE_SPACE - 1)) >= threshold) {
+        return;
+    }
+
+    samples++;
+
+    // Old accesses fade out, so the estimates follow the workload as it changes.
+    bool decay = samples % DECAY_EVERY == 0;
+
+    for (Ghost& ghost : ghosts) {
+        auto it = ghost.index.find(hash);
+        ghost.accesses++;
+
+        if (it != ghost.index.end()) {
+            ghost.hits++;
+            ghost.lru.splice(ghost.lru.begin(), ghost.lru, it->second);
+        } else {
+            if (ghost.lru.size() >= ghost.capacity) {
+                ghost.index.erase(ghost.lru.back());
+                ghost.lru.pop_back();
+            }
+
+            ghost.lru.push_front(hash);
+            ghost.index.emplace(hash, ghost.lru.begin());
+        }
+
+        if (decay) {
+            ghost.hits /= 2;
+            ghost.accesses /= 2;
+        }
+    }
+}
+
+CacheSpace::MissRatioEstimator::Curve CacheSpace::MissRatioEstimator::Estimates() const {
+    Curve curve;
+    curve.sample_rate = static_cast<double>(threshold) / SAMPLE_SPACE;
+    curve.samples = samples;
+    curve.warm = samples >= 2 * ghosts.back().capacity;
+
+    for (size_t i = 0; i < SCALES.size(); i++) {
+        const Ghost& ghost = ghosts[i];
+        size_t target = std::max<size_t>(1, std::llround(capacity * SCALES[i]));
+        curve.points.push_back({SCALES[i], target, ghost.accesses > 0 ? ghost.hits / ghost.accesses : 0.0});
+    }
+
+    return curve;
+}
@@ -1,79 +1,304 @@
 #include "Proxy.hpp"
+#include "Compression.hpp"
+#include "Hash.hpp"
+#include "HttpDate.hpp"
+#include "VaryNormalizer.hpp"
 #include <nlohmann/json.hpp>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <random>
+
+namespace {
+    int64_t NowMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
 
-void ProxySpace::Proxy::BuildClients() {
-    const auto create_client = [&](const std::string &origin) {
-        HttpClient client = std::make_unique<httplib::SSLClient>(origin.c_str());
-        client->enable_server_certificate_verification(true); // ensures HTTPS works
-        client->set_keep_alive(true);
-        client->set_read_timeout(5, 0);
-        client->set_connection_timeout(5, 0);
-
-        return client;
+    // What happened to the request the current thread is handling, for the access log. Server
+    // threads handle one request at a time, so no synchronization is needed.
+    struct RequestTrace {
+        ProxySpace::CacheOutcome outcome{ProxySpace::CacheOutcome::Miss};
+        int64_t cache_lookup_us{0};
+        int64_t origin_start_us{0};
+        int64_t origin_connected_us{0}; // set once the TLS handshake completes
+        int64_t origin_headers_us{0};
+    };
+
+    thread_local RequestTrace trace;
+
+    // Origins are HTTPS unless configured with an explicit "http://", which is kept for the
+    // client and dropped from the Host header.
+    std::string_view OriginHost(std::string_view origin) {
+        return origin.starts_with("http://") ? origin.substr(7) : origin;
+    }
+
+    // Accept-Ranges is a list of range units (RFC 9110 section 14.3).
+    bool AcceptsByteRanges(const httplib::Response& response) {
+        std::string header = response.get_header_value("Accept-Ranges");
+        std::string_view units = header;
+
+        while (!units.empty()) {
+            size_t comma = units.find(',');
+            std::string_view unit = units.substr(0, comma);
+            unit.remove_prefix(std::min(unit.find_first_not_of(" \t"), unit.size()));
+            unit = unit.substr(0, unit.find_last_not_of(" \t") + 1);
+
+            if (unit.size() == 5 && std::equal(unit.begin(), unit.end(), "bytes", [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; })) {
+                return true;
+            }
+
+            units = comma == std::string_view::npos ? std::string_view{} : units.substr(comma + 1);
+        }
+
+        return false;
+    }
+
+    // Counts an origin request for as long as it is in flight.
+    struct InFlight {
+        std::atomic<int64_t>& gauge;
+
+        explicit InFlight(std::atomic<int64_t>& gauge) : gauge(gauge) {
+            gauge.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        ~InFlight() {
+            gauge.fetch_sub(1, std::memory_order_relaxed);
+        }
     };
+}
+
+ProxySpace::HttpClient ProxySpace::Proxy::CreateClient(const std::string &origin) {
+    HttpClient client = std::make_unique<httplib::Client>(origin.starts_with("http://") ? origin : "https://" + origin);
+    client->enable_server_certificate_verification(true); // ensures HTTPS works
+    client->set_keep_alive(true);
+    client->set_read_timeout(5, 0);
+    client->set_connection_timeout(5, 0);
+    client->set_decompress(false); // encoded bodies are cached as they arrive
+
+    // Runs on the requesting thread right after the handshake; only used to time the connect.
+    client->set_server_certificate_verifier([](SSL*) {
+        trace.origin_connected_us = NowMicros();
+        return httplib::SSLVerifierResponse::NoDecisionMade;
+    });
+
+    return client;
+}
+
+// Segment fetches need a connection each, so they take clients from a pool per origin that
+// keeps their connections (and TLS sessions) open between rounds.
+ProxySpace::HttpClient ProxySpace::Proxy::AcquireClient(const std::string &origin) {
+    {
+        std::lock_guard lock(client_pool_mtx);
+        auto& idle = client_pool[origin];
+
+        if (!idle.empty()) {
+            HttpClient client = std::move(idle.back());
+            idle.pop_back();
+            return client;
+        }
+    }
+
+    return CreateClient(origin);
+}
+
+void ProxySpace::Proxy::ReleaseClient(const std::string &origin, HttpClient client) {
+    constexpr size_t MAX_IDLE = 16;
+    std::lock_guard lock(client_pool_mtx);
+    auto& idle = client_pool[origin];
+
+    if (idle.size() < MAX_IDLE) {
+        idle.push_back(std::move(client));
+    }
+}
 
-    clients[config.origin_url] = create_client(config.origin_url);
+void ProxySpace::Proxy::BuildClients() {
+    clients[config.origin_url] = CreateClient(config.origin_url);
     
     for (const auto& route : config.routes) {
-        clients[route.origin] = create_client(route.origin);
+        clients[route.origin] = CreateClient(route.origin);
         std::cout << "Created client for route prefix: " << route.prefix << ", origin: " << route.origin << "\n";
     }
 }
 
-void ProxySpace::Proxy::BuildEndpoints() {
-    endpoints["/stats"] = [this](const httplib::Request& req, httplib::Response& res) {
-        auto accept_it = req.headers.find("Accept");
+// Resolves every route's client and policy once and indexes the prefixes for SelectRoute.
+void ProxySpace::Proxy::BuildRoutes() {
+    routes.reserve(config.routes.size() + 1); // the trie holds pointers into the vector
+    routes.push_back({"", config.origin_url, config.policy, clients.at(config.origin_url).get(), std::make_shared<RouteMetrics>()});
 
-        if (accept_it != req.headers.end() && accept_it->second.find("application/json") != std::string::npos) {
-            nlohmann::json j;
-            j["hits"] = cache.GetHits();
-            j["misses"] = cache.GetMisses();
-            j["compliant_misses"] = cache.GetCompliantMisses();
-            auto hits_and_misses = cache.GetURLHitsAndMisses();
-            nlohmann::json url_info;
-
-            for (const auto& pair : hits_and_misses) {
-                url_info[pair.first] = {
-                    {"hits", pair.second.first},
-                    {"misses", pair.second.second}
-                };
-            }
+    for (const auto& route : config.routes) {
+        routes.push_back({route.prefix, route.origin, route.policy, clients.at(route.origin).get(), std::make_shared<RouteMetrics>()});
+    }
 
-            j["url_hits_and_misses"] = url_info;
-            res.set_content(j.dump(4), "application/json");
+    // The first route configured for a prefix wins, as with the linear scan this replaced. A
+    // configured "" route still takes over from the default origin.
+    for (size_t i = 1; i < routes.size(); i++) {
+        if (!route_trie.Insert(routes[i].prefix, &routes[i])) {
+            LogMessage(LogLevel::Warn, "Ignoring route " + routes[i].prefix + " -> " + routes[i].origin + ": an earlier route has the same prefix");
+        }
+    }
 
-            return;
+    route_trie.Insert(routes.front().prefix, &routes.front());
+}
+
+void ProxySpace::Proxy::BuildEndpoints() {
+    // GET /stats?prefix=/api&limit=100 lists URLs in order, a page at a time: pass the previous
+    // page's last URL as ?cursor= for the next one. ?top=10 lists the most requested instead.
+    endpoints["/stats"] = [this](const httplib::Request& req, httplib::Response& res) {
+        constexpr size_t DEFAULT_LIMIT = 100;
+        constexpr size_t MAX_LIMIT = 10000;
+
+        CacheSpace::UrlStatsQuery query;
+        query.prefix = req.get_param_value("prefix");
+        query.cursor = req.get_param_value("cursor");
+        query.top = req.has_param("top");
+        query.limit = DEFAULT_LIMIT;
+        std::string limit = req.get_param_value(query.top ? "top" : "limit");
+
+        if (!limit.empty()) {
+            auto [end, error] = std::from_chars(limit.data(), limit.data() + limit.size(), query.limit);
+
+            if (error != std::errc{} || end != limit.data() + limit.size()) {
+                res.status = 400;
+                res.set_content("Invalid limit\n", "text/plain");
+                return;
+            }
         }
 
-        auto hits_and_misses = cache.GetURLHitsAndMisses();
+        query.limit = std::clamp<size_t>(query.limit, 1, MAX_LIMIT);
+        auto page = std::make_shared<std::vector<CacheSpace::UrlCounts>>(cache.GetURLHitsAndMisses(query));
+        std::string next_cursor = !query.top && page->size() == query.limit ? page->back().url : "";
+
+        auto accept_it = req.headers.find("Accept");
+        bool json = accept_it != req.headers.end() && accept_it->second.find("application/json") != std::string::npos;
 
-        if (hits_and_misses.empty() && cache.GetCompliantMisses() == 0) {
+        if (!json && page->empty() && !cache.HasURLStats() && cache.GetCompliantMisses() == 0) {
             res.set_content("No cache activity yet.\n", "text/plain");
             return;
         }
 
-        std::string per_url_info;
+        // Invalid UTF-8 in a URL is replaced rather than failing the whole response.
+        auto quote = [](const std::string& value) {
+            return nlohmann::json(value).dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+        };
+
+        auto curve = cache.EstimateHitRatios();
+        std::string estimates;
+
+        for (const auto& point : curve.points) {
+            char ratio[16];
+            std::snprintf(ratio, sizeof(ratio), "%.4f", point.hit_ratio);
+
+            if (json) {
+                estimates += std::string(estimates.empty() ? "" : ", ") + "{\"capacity\": " + std::to_string(point.capacity)
+                    + ", \"scale\": " + nlohmann::json(point.scale).dump() + ", \"hit_ratio\": " + ratio + "}";
+            } else {
+                char scale[16];
+                std::snprintf(scale, sizeof(scale), "%g", point.scale);
+                estimates += "Estimated hit ratio at " + std::to_string(point.capacity) + " entries (" + scale + "x): " + ratio + "\n";
+            }
+        }
 
-        for (const auto& pair : hits_and_misses) {
-            per_url_info += pair.first + ": Hits: "
-                + std::to_string(pair.second.first)
-                + ", Misses: " + std::to_string(pair.second.second) + "\n";
+        std::string head;
+        std::string tail;
+
+        if (json) {
+            head = "{\"hits\": " + std::to_string(cache.GetHits())
+                + ", \"misses\": " + std::to_string(cache.GetMisses())
+                + ", \"compliant_misses\": " + std::to_string(cache.GetCompliantMisses())
+                + ", \"capacity\": " + std::to_string(cache.GetCapacity())
+                + ", \"estimated_hit_ratios\": {\"samples\": " + std::to_string(curve.samples)
+                + ", \"sample_rate\": " + nlohmann::json(curve.sample_rate).dump()
+                + ", \"warm\": " + (curve.warm ? "true" : "false")
+                + ", \"points\": [" + estimates + "]}"
+                + ", \"urls\": [";
+            tail = std::string(page->empty() ? "" : "\n") + "], \"next_cursor\": "
+                + (next_cursor.empty() ? "null" : quote(next_cursor)) + "}\n";
+        } else {
+            head = "Hits: " + std::to_string(cache.GetHits()) + "\n"
+                "Misses: " + std::to_string(cache.GetMisses()) + "\n"
+                "Compliant Misses: " + std::to_string(cache.GetCompliantMisses()) + "\n"
+                "Capacity: " + std::to_string(cache.GetCapacity()) + "\n"
+                + (curve.warm ? estimates : "") +
+                "Hits and misses (non-compliant) broken down by url:\n";
+            tail = next_cursor.empty() ? "" : "Next cursor: " + next_cursor + "\n";
         }
 
-        res.set_content(
-            "Hits: " + std::to_string(cache.GetHits()) + "\n"
-            "Misses: " + std::to_string(cache.GetMisses()) + "\n"
-            "Compliant Misses: " + std::to_string(cache.GetCompliantMisses()) + "\n"
-            "Hits and misses (non-compliant) broken down by url:\n" + per_url_info,
-            "text/plain"
+        // Written a batch of URLs at a time, so a large page is never rendered in one piece.
+        res.set_chunked_content_provider(json ? "application/json" : "text/plain",
+            [page, json, quote, head = std::move(head), tail = std::move(tail), next = size_t{0}](size_t, httplib::DataSink& sink) mutable {
+                constexpr size_t BATCH = 256;
+                std::string chunk;
+
+                if (next == 0) {
+                    chunk = std::move(head);
+                }
+
+                for (size_t end = std::min(next + BATCH, page->size()); next < end; next++) {
+                    const auto& entry = (*page)[next];
+
+                    if (json) {
+                        chunk += std::string(next == 0 ? "\n" : ",\n") + "{\"url\": " + quote(entry.url)
+                            + ", \"hits\": " + std::to_string(entry.hits)
+                            + ", \"misses\": " + std::to_string(entry.misses) + "}";
+                    } else {
+                        chunk += entry.url + ": Hits: " + std::to_string(entry.hits)
+                            + ", Misses: " + std::to_string(entry.misses) + "\n";
+                    }
+                }
+
+                bool finished = next == page->size();
+
+                if (finished) {
+                    chunk += tail;
+                }
+
+                if (!sink.write(chunk.data(), chunk.size())) {
+                    return false;
+                }
+
+                if (finished) {
+                    sink.done();
+                }
+
+                return true;
+            }
         );
     };
 
     endpoints["/clear-cache"] = [this](const httplib::Request&, httplib::Response& res) {
         cache.clear();
+        decompressed_cache.clear();
         res.set_content("Cache cleared.\n", "text/plain");
     };
 
+    // GET /log-level shows the level (process-wide) and how many records were dropped;
+    // ?set=debug|info|warn|error|off changes it.
+    endpoints["/log-level"] = [](const httplib::Request& req, httplib::Response& res) {
+        if (req.has_param("set")) {
+            auto level = Logger::ParseLevel(req.get_param_value("set"));
+
+            if (!level) {
+                res.status = 400;
+                res.set_content("Unknown log level\n", "text/plain");
+                return;
+            }
+
+            Logger::SetLevel(*level);
+        }
+
+        nlohmann::json j;
+        j["level"] = Logger::LevelName(Logger::GetLevel());
+        j["dropped"] = Logger::Dropped();
+        res.set_content(j.dump(4), "application/json");
+    };
+
+    endpoints["/metrics"] = [this](const httplib::Request&, httplib::Response& res) {
+        res.set_content(RenderMetrics(), "text/plain; version=0.0.4");
+    };
+
     endpoints["/healthz"] = [this](const httplib::Request&, httplib::Response& res) {
         res.set_content("OK", "text/plain");
     };
@@ -91,29 +316,130 @@ bool ProxySpace::Proxy::MatchesEndpoint(const std::string &key, const httplib::R
     return true;
 }
 
-void ProxySpace::Proxy::LogMessage(const std::string &message) {
-    std::cout << "[PORT " << config.port << "] " << message << "\n";
+std::string ProxySpace::Proxy::RenderMetrics() const {
+    std::string out;
+    std::string port = "port=\"" + std::to_string(config.port) + "\"";
+
+    AppendMetricHeader(out, "proxy_request_duration_seconds", "histogram", "Time to answer a proxied request, by route and cache outcome.");
+
+    for (const auto& route : routes) {
+        for (auto outcome : {CacheOutcome::Hit, CacheOutcome::Miss, CacheOutcome::Revalidated, CacheOutcome::Stale, CacheOutcome::Coalesced}) {
+            const Histogram& histogram = route.metrics->latency[static_cast<size_t>(outcome)];
+            std::string labels = port + ",route=\"" + EscapeLabel(route.prefix) + "\",outcome=\"" + std::string(OutcomeName(outcome)) + "\"";
+            AppendHistogram(out, "proxy_request_duration_seconds", labels, histogram);
+        }
+    }
+
+    AppendMetricHeader(out, "proxy_origin_duration_seconds", "histogram", "Time from sending a request to the origin until its response headers arrived.");
+
+    for (const auto& route : routes) {
+        AppendHistogram(out, "proxy_origin_duration_seconds", port + ",route=\"" + EscapeLabel(route.prefix) + "\"", route.metrics->origin_latency);
+    }
+
+    AppendMetricHeader(out, "proxy_served_bytes_total", "counter", "Response body bytes served to clients.");
+
+    for (const auto& route : routes) {
+        AppendMetric(out, "proxy_served_bytes_total", port + ",route=\"" + EscapeLabel(route.prefix) + "\"", static_cast<double>(route.metrics->bytes_served.Value()));
+    }
+
+    const std::pair<const char*, const CacheSpace::Cache*> caches[] = {{"main", &cache}, {"decompressed", &decompressed_cache}};
+
+    AppendMetricHeader(out, "proxy_cache_entries", "gauge", "Entries held by the cache.");
+
+    for (const auto& [name, c] : caches) {
+        AppendMetric(out, "proxy_cache_entries", port + ",cache=\"" + name + "\"", static_cast<double>(c->Size()));
+    }
+
+    AppendMetricHeader(out, "proxy_cache_bytes", "gauge", "Body bytes held by the cache.");
+
+    for (const auto& [name, c] : caches) {
+        AppendMetric(out, "proxy_cache_bytes", port + ",cache=\"" + name + "\"", static_cast<double>(c->Bytes()));
+    }
+
+    AppendMetricHeader(out, "proxy_cache_evictions_total", "counter", "Entries removed from the cache, by reason.");
+    const std::pair<const char*, CacheSpace::EvictionReason> reasons[] = {
+        {"capacity", CacheSpace::EvictionReason::Capacity},
+        {"expired", CacheSpace::EvictionReason::Expired},
+        {"superseded", CacheSpace::EvictionReason::Superseded},
+        {"cleared", CacheSpace::EvictionReason::Cleared},
+    };
+
+    for (const auto& [name, c] : caches) {
+        for (const auto& [reason_name, reason] : reasons) {
+            AppendMetric(out, "proxy_cache_evictions_total", port + ",cache=\"" + name + "\",reason=\"" + reason_name + "\"", static_cast<double>(c->Evictions(reason)));
+        }
+    }
+
+    AppendMetricHeader(out, "proxy_origin_requests_in_flight", "gauge", "Requests to origins currently outstanding.");
+    AppendMetric(out, "proxy_origin_requests_in_flight", port, static_cast<double>(origin_in_flight.load(std::memory_order_relaxed)));
+
+    AppendMetricHeader(out, "proxy_task_queue_depth", "gauge", "Accepted connections and other work waiting for a worker thread.");
+    AppendMetric(out, "proxy_task_queue_depth", port, static_cast<double>(group->Queued()));
+
+    AppendMetricHeader(out, "proxy_tasks_running", "gauge", "Worker threads busy with this proxy's work.");
+    AppendMetric(out, "proxy_tasks_running", port, static_cast<double>(group->Running()));
+
+#ifdef __linux__
+    if (event_server) {
+        AppendMetricHeader(out, "proxy_client_connections", "gauge", "Client connections open on the event front end.");
+        AppendMetric(out, "proxy_client_connections", port, static_cast<double>(event_server->Connections()));
+    }
+#endif
+
+    const Runtime& runtime = Runtime::Instance();
+    AppendMetricHeader(out, "proxy_worker_threads", "gauge", "Worker threads shared by all proxies in the process.");
+    AppendMetric(out, "proxy_worker_threads", "", static_cast<double>(runtime.Threads()));
+
+    AppendMetricHeader(out, "proxy_task_steals_total", "counter", "Tasks a worker took from another worker's deque.");
+    AppendMetric(out, "proxy_task_steals_total", "", static_cast<double>(runtime.Steals()));
+
+    AppendMetricHeader(out, "proxy_log_dropped_total", "counter", "Log records dropped because a logging ring was full.");
+    AppendMetric(out, "proxy_log_dropped_total", "", static_cast<double>(Logger::Dropped()));
+
+    if (access_log) {
+        AppendMetricHeader(out, "proxy_access_log_dropped_total", "counter", "Access log records dropped because the writer fell behind.");
+        AppendMetric(out, "proxy_access_log_dropped_total", port, static_cast<double>(access_log->Dropped()));
+    }
+
+    return out;
+}
+
+void ProxySpace::Proxy::LogMessage(LogLevel level, std::string_view message) {
+    Logger::Log(level, config.port, message);
+}
+
+CacheSpace::Lookup ProxySpace::Proxy::LookUp(const Route &route, const std::string &url, const httplib::Request &req) {
+    int64_t lookup_start = NowMicros();
+    auto lookup = cache.Find(url, [&](const std::vector<std::string>& vary) { return VariantHash(route.policy, req, vary); });
+    trace.cache_lookup_us = NowMicros() - lookup_start;
+
+    return lookup;
 }
 
-bool ProxySpace::Proxy::CheckCacheForResponse(const std::string &key, const std::string &path, httplib::Response &res) {
-    auto cached = cache.get(key);
-    int64_t now = cache.GetCurrentSeconds();
+bool ProxySpace::Proxy::CheckCacheForResponse(const Route &route, const CacheSpace::Lookup &lookup, const httplib::Request &req, httplib::Response &res) {
+    const std::string& path = req.target;
+    const auto& [key, cached] = lookup;
+    int64_t now = cache.GetCurrentMillis();
 
     if (!cached) {
         return false;
     }
 
-    if (cached->expires_at <= now) {
+    if (cached->ExpiresAt() <= now) {
+        // stale-while-revalidate: answer with what we have and let a background refresh catch up.
+        if (now < cached->ExpiresAt() + cached->stale_while_revalidate_ms) {
+            trace.outcome = CacheOutcome::Stale;
+            ScheduleRefresh(key, req);
+            ServeCached(route, key, cached, req, res);
+            return true;
+        }
+
         httplib::Headers headers;
-        headers.insert({"Host", config.origin_url});
+        headers.insert({"Host", std::string(OriginHost(route.origin))});
         headers.insert({"Connection", "close"});
 
-        if (cached->headers.contains("ETag")) {
-            auto it = cached->headers.find("ETag");
-
-            if (it != cached->headers.end()) {
-                headers.insert({"If-None-Match", it->second});
-            }
+        if (!cached->origin_etag.empty()) {
+            headers.insert({"If-None-Match", cached->origin_etag});
         }
 
         if (cached->headers.contains("Last-Modified")) {
@@ -124,7 +450,47 @@ bool ProxySpace::Proxy::CheckCacheForResponse(const std::string &key, const std:
             }
         }
 
-        auto origin_res = clients.at(SelectOrigin(path))->Get(path.c_str(), headers);
+        // Without a validator the origin can only answer with the full body, which the
+        // refetch compares against content_hash instead.
+        if (!headers.contains("If-None-Match") && !headers.contains("If-Modified-Since")) {
+            return false;
+        }
+
+        // Revalidate the representation the origin sent, which may have been compressed here since.
+        auto encoding_it = cached->headers.find("Content-Encoding");
+        bool as_sent = encoding_it != cached->headers.end() && !cached->compressed_in_cache;
+        headers.insert({"Accept-Encoding", as_sent ? encoding_it->second : "identity"});
+
+        // A changed object is fetched again below, so there is no point downloading it here.
+        // Server errors are cut short too; they are answered from the stale entry when allowed.
+        bool modified = false;
+        int origin_status = 0;
+        auto request_start = std::chrono::steady_clock::now();
+        trace.origin_start_us = NowMicros();
+        InFlight in_flight(origin_in_flight);
+        auto origin_res = route.client->Get(
+            path.c_str(),
+            headers,
+            [&](const httplib::Response& response) {
+                trace.origin_headers_us = NowMicros();
+                origin_status = response.status;
+                modified = response.status != 304;
+                return !modified;
+            },
+            [](const char*, size_t) { return true; }
+        );
+
+        bool origin_failed = (!origin_res && !modified) || origin_status >= 500;
+
+        if (origin_failed && now < cached->ExpiresAt() + cached->stale_if_error_ms) {
+            trace.outcome = CacheOutcome::Stale;
+            ServeCached(route, key, cached, req, res);
+            return true;
+        }
+
+        if (!origin_res && modified) {
+            return false;
+        }
 
         if (!origin_res) {
             res.status = 502;
@@ -133,19 +499,34 @@ bool ProxySpace::Proxy::CheckCacheForResponse(const std::string &key, const std:
         }
 
         if (origin_res->status == 304) {
-            cached->expires_at = now + config.ttl;
-            cache.put(key, *cached);
+            // The 304 may carry new freshness information; whatever it leaves out is taken from the
+            // stored response. Date and Age always describe the 304 itself.
+            httplib::Headers freshness_headers = origin_res->headers;
+
+            for (const char* name : {"Cache-Control", "Expires", "Last-Modified"}) {
+                auto it = cached->headers.find(name);
+
+                if (it != cached->headers.end() && !freshness_headers.contains(name)) {
+                    freshness_headers.insert({name, it->second});
+                }
+            }
+
+            auto cc_it = freshness_headers.find("Cache-Control");
+            CacheControl cache_control = cc_it != freshness_headers.end() ? ParseCacheControl(cc_it->second) : CacheControl{};
+            int64_t response_delay = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - request_start
+            ).count();
 
-            res.status = cached->status;
-            res.headers = cached->headers;
-            res.body = cached->body;
+            int64_t freshness = FreshnessMillis(cached->status, cache_control, freshness_headers, route.policy, response_delay);
+            cache.Renew(key, cached->generation, now + std::max<int64_t>(freshness, 0));
+            trace.outcome = CacheOutcome::Revalidated;
+
+            ServeCached(route, key, cached, req, res);
 
             return true;
         }
     } else {
-        res.status = cached->status;
-        res.headers = cached->headers;
-        res.body = cached->body;
+        ServeFresh(route, key, cached, req, res, now);
 
         return true;
     }
@@ -153,212 +534,1205 @@ bool ProxySpace::Proxy::CheckCacheForResponse(const std::string &key, const std:
     return false;
 }
 
-std::string ProxySpace::Proxy::MakeCacheKey(const httplib::Request& req, const std::string& vary_spec) const {
-    std::string key = req.target;
-
-    if (key.empty()) {
-        key = "/";
-        return key;
+// A hit on an entry the caller found fresh at now; never goes to the origin itself.
+void ProxySpace::Proxy::ServeFresh(const Route &route, const std::string &key, const std::shared_ptr<CacheSpace::CachedResponse> &cached, const httplib::Request &req, httplib::Response &res, int64_t now) {
+    if (ShouldRefreshEarly(*cached, now)) {
+        ScheduleRefresh(key, req);
     }
 
-    if (!vary_spec.empty()) {
-        std::stringstream ss(vary_spec);
-        std::string header_name;
+    trace.outcome = CacheOutcome::Hit;
 
-        while (std::getline(ss, header_name, ',')) {
-            header_name.erase(0, header_name.find_first_not_of(" \t"));
-            header_name.erase(header_name.find_last_not_of(" \t") + 1);
-            auto hdr_it = req.headers.find(header_name);
+    ServeCached(route, key, cached, req, res);
+}
 
-            if (hdr_it != req.headers.end()) {
-                key += "|" + header_name + "=" + hdr_it->second;
-            }
-        }
+// stale-if-error for the refetch path, once the origin failed to produce a replacement.
+bool ProxySpace::Proxy::ServeStaleOnError(const Route &route, const std::string &url, const httplib::Request &req, httplib::Response &res) {
+    auto [key, cached] = cache.Find(url, [&](const std::vector<std::string>& vary) { return VariantHash(route.policy, req, vary); });
+
+    if (!cached || cache.GetCurrentMillis() >= cached->ExpiresAt() + cached->stale_if_error_ms) {
+        return false;
     }
 
-    return key;
+    res.body.clear();
+    trace.outcome = CacheOutcome::Stale;
+    ServeCached(route, key, cached, req, res);
+
+    return true;
 }
 
-void ProxySpace::Proxy::HandleRequest(const httplib::Request &req, httplib::Response &res) {
-    std::string key = MakeCacheKey(req, cache.GetVarySpec(req.target));
-    LogMessage("Received request for " + key);
+// Hits are written straight out of the cached buffer through a content provider, so neither
+// full bodies nor Range slices are copied. httplib cuts the provider down to the requested
+// ranges (including multipart/byteranges) once the status is 206.
+void ProxySpace::Proxy::ServeCached(const Route &route, const std::string &key, const std::shared_ptr<CacheSpace::CachedResponse> &stored, const httplib::Request &req, httplib::Response &res, bool store_segments) {
+    // Entries held gzip-compressed go out as they are to clients that accept gzip.
+    std::shared_ptr<CacheSpace::CachedResponse> cached = stored;
+    auto encoding_it = stored->headers.find("Content-Encoding");
+    bool is_gzip = encoding_it != stored->headers.end() && encoding_it->second == "gzip";
 
-    if (MatchesEndpoint(req.target, req, res)) {
-        return;
+    if (is_gzip && !CacheSpace::AcceptsEncoding(req, "gzip")) {
+        cached = Decompressed(route, key, stored);
+
+        if (!cached) {
+            res.status = 502;
+            res.set_content("Proxy error: could not decode cached response", "text/plain");
+            return;
+        }
+    }
+
+    res.status = cached->status;
+    res.headers = cached->headers;
+    res.headers.erase("Content-Length"); // httplib writes its own
+
+    if (is_gzip && res.get_header_value("Vary").find("Accept-Encoding") == std::string::npos) {
+        res.headers.insert({"Vary", "Accept-Encoding"});
     }
 
-    if (CheckCacheForResponse(key, req.target, res)) {
-        cache.LogEvent(key, true);
+    if (cached->status == 200 && IsNotModified(req, *cached)) {
+        // Headers only, with the length the full response would have had.
+        res.status = 304;
+        res.headers.insert({"Content-Length", std::to_string(cached->ContentLength())});
         return;
     }
 
-    httplib::Headers headers;
-    headers.insert({"Host", config.origin_url});
-    headers.insert({"Connection", "close"});
-    std::string origin_host = SelectOrigin(req.target);
-    std::cout << "Selected origin: " << origin_host << " for request path: " << req.target << "\n";
+    size_t length = cached->ContentLength();
 
-    if (!clients.contains(origin_host)) {
-        res.status = 502;
-        res.set_content("Proxy error: unknown origin", "text/plain");
+    if (length == 0) {
         return;
     }
 
-    auto cli = clients.at(origin_host).get();
-    std::string body;
-    bool too_large = false;
+    std::string content_type = "application/octet-stream";
+    auto type_it = res.headers.find("Content-Type");
+
+    if (type_it != res.headers.end()) {
+        content_type = type_it->second;
+        res.headers.erase(type_it);
+    }
 
-    auto origin_res = cli->Get(
-        req.target.c_str(),
-        headers,
-        [&](const char* data, size_t length) {
-            constexpr size_t MAX_RESPONSE_SIZE = 2 * 1024 * 1024;
+    if (cached->status == 200) {
+        res.headers.insert({"Accept-Ranges", "bytes"});
 
-            if (body.size() + length > MAX_RESPONSE_SIZE) {
-                too_large = true;
-                return false;
+        if (!req.ranges.empty() && RangeApplies(req, *cached)) {
+            if (!RangesSatisfiable(req.ranges, length)) {
+                res.status = 416;
+                res.headers.insert({"Content-Range", "bytes */" + std::to_string(length)});
+                return;
             }
 
-            body.append(data, length);
-            return true;
+            res.status = 206;
         }
-    );
-
-    if (!origin_res) {
-        std::string error_msg = "Proxy error: " + httplib::to_string(origin_res.error());
-        res.status = 502;
-        res.set_content(error_msg, "text/plain");
-        return;
     }
 
-    if (too_large) {
-        res.status = 413;
-        res.set_content("Origin response too large", "text/plain");
+    if (cached->IsSegmented()) {
+        res.set_content_provider(
+            length,
+            content_type,
+            [this, route = &route, cached, store_segments, key, target = req.target](
+                size_t offset, size_t length, httplib::DataSink &sink
+            ) {
+                return WriteSegments(*route, key, target, cached, store_segments, offset, length, sink);
+            }
+        );
+
         return;
     }
 
-    std::optional<int64_t> max_age;
-    auto cache_it = origin_res->headers.find("Cache-Control");
+    res.set_content_provider(
+        length,
+        content_type,
+        [cached](size_t offset, size_t length, httplib::DataSink &sink) {
+            return sink.write(cached->body.data() + offset, length);
+        }
+    );
+}
+
+// Identity copies of gzip entries are kept in a small cache of their own, so that clients
+// without gzip support do not cost a decompression on every hit of a hot object.
+std::shared_ptr<CacheSpace::CachedResponse> ProxySpace::Proxy::Decompressed(const Route &route, const std::string &key, const std::shared_ptr<CacheSpace::CachedResponse> &stored) {
+    auto hot = decompressed_cache.get(key);
 
-    if (cache_it != origin_res->headers.end()) {
-        max_age = ParseMaxAge(cache_it->second);
+    if (hot && hot->generation == stored->generation) {
+        return hot;
     }
 
-    res.status = origin_res->status;
-    res.body = origin_res->body;
-    res.headers.clear();
-    httplib::Headers filtered_headers;
+    const RoutePolicy& policy = route.policy;
+    auto body = CacheSpace::GzipDecompress(stored->body, std::max(policy.max_response_size, policy.max_object_size));
 
-    for (const auto& [hdr, value] : origin_res->headers) {
-        std::string lower = hdr;
-        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (!body) {
+        LogMessage(LogLevel::Warn, "Failed to decompress cached response for " + key);
+        return nullptr;
+    }
 
-        if (!ProxySpace::hop_by_hop.contains(lower)) {
-            filtered_headers.insert({hdr, value});
+    auto identity = std::make_shared<CacheSpace::CachedResponse>();
+    identity->status = stored->status;
+    identity->expires_at = stored->ExpiresAt();
+    identity->headers = stored->headers;
+    identity->headers.erase("Content-Encoding");
+
+    // Back to the identity body's ETag when the gzip copy was made here: the origin's, or the
+    // one synthesized from content_hash, which hashes the body before compression. An identity
+    // copy of what the origin sent gzipped is a representation the origin never tagged, so it
+    // gets its own.
+    auto etag_it = identity->headers.find("ETag");
+
+    if (etag_it != identity->headers.end()) {
+        if (!stored->compressed_in_cache) {
+            etag_it->second = CacheSpace::EncodingETag(etag_it->second, "identity");
+        } else if (!stored->origin_etag.empty()) {
+            etag_it->second = stored->origin_etag;
+        } else {
+            etag_it->second = CacheSpace::SynthesizedETag(stored->content_hash);
         }
     }
+    identity->body = std::move(*body);
+    identity->generation = stored->generation;
+    decompressed_cache.put(key, identity);
 
-    filtered_headers.insert({"Content-Length", std::to_string(res.body.size())});
-    res.headers = filtered_headers;
-    res.headers.insert({"X-Cache", "MISS"});
-    int64_t now = cache.GetCurrentSeconds();
-    int64_t to_add = config.ttl;
+    return identity;
+}
 
-    if (max_age) {
-        to_add = *max_age;
+// Stores compressible bodies gzipped when that saves a meaningful amount of memory.
+void ProxySpace::Proxy::CompressForStorage(CacheSpace::CachedResponse &cached, const RoutePolicy &policy) {
+    if (!policy.compress_in_cache || cached.status != 200 || cached.body.size() < policy.compress_min_size
+        || cached.headers.contains("Content-Encoding")) {
+        return;
     }
 
-    if (to_add == 0) {
-        cache.IncrementCompliantMisses();
+    auto type_it = cached.headers.find("Content-Type");
+
+    if (type_it == cached.headers.end() || !CacheSpace::IsCompressibleType(type_it->second)) {
         return;
     }
 
-    std::string vary_spec;
-    auto vary_it = origin_res->headers.find("Vary");
+    auto compressed = CacheSpace::GzipCompress(cached.body);
 
-    if (vary_it != origin_res->headers.end()) {
-        vary_spec = vary_it->second;
-        cache.SetVarySpec(req.target, vary_spec);
-    }
+    if (compressed && compressed->size() < cached.body.size() - cached.body.size() / 10) {
+        cached.body = std::move(*compressed);
+        cached.headers.insert({"Content-Encoding", "gzip"});
+        cached.compressed_in_cache = true;
 
-    std::string storage_key = MakeCacheKey(req, vary_spec);
+        // The gzip copy is a representation of its own, so it gets an ETag of its own.
+        auto etag_it = cached.headers.find("ETag");
 
-    CacheSpace::CachedResponse cached;
-    cached.status = origin_res->status;
-    cached.body = origin_res->body;
-    cached.headers = filtered_headers;
-    cached.headers.insert({"X-Cache", "HIT"});
-    cached.expires_at = (to_add < 0) ? now : now + to_add;
-    cache.put(storage_key, cached);
-    cache.LogEvent(storage_key, false);
+        if (etag_it != cached.headers.end()) {
+            etag_it->second = CacheSpace::EncodingETag(etag_it->second, "gzip");
+        }
+    }
 }
 
-void ProxySpace::Proxy::TTLFunction() {
-    while (is_running) {
-        {
-            std::unique_lock<std::mutex> lock(cache.ttl_mtx);
-            cache.ttl_cv.wait_for(lock, std::chrono::seconds(1));
+// Writes [offset, offset + length) of a segmented object. Segments still in the cache are
+// written from there; missing ones are fetched from the origin with Range requests, several
+// at a time, so a partially cached object only costs the segments that were evicted.
+bool ProxySpace::Proxy::WriteSegments(
+    const Route &route,
+    const std::string &key,
+    const std::string &target,
+    const std::shared_ptr<CacheSpace::CachedResponse> &manifest,
+    bool store_segments,
+    size_t offset,
+    size_t length,
+    httplib::DataSink &sink
+) {
+    const RoutePolicy& policy = route.policy;
+    const size_t segment_size = manifest->segment_size;
+    const size_t end = offset + length;
+    const size_t last = (end - 1) / segment_size;
+    std::unordered_map<size_t, std::shared_ptr<CacheSpace::CachedResponse>> fetched;
+
+    for (size_t index = offset / segment_size; index <= last; index++) {
+        std::shared_ptr<CacheSpace::CachedResponse> segment;
+        auto fetched_it = fetched.find(index);
+
+        if (fetched_it != fetched.end()) {
+            segment = fetched_it->second;
+        } else if (store_segments) {
+            segment = cache.get(CacheSpace::SegmentKey(key, manifest->generation, index));
+        }
+
+        if (!segment) {
+            // Fetch a window of the missing segments from here on in one parallel round.
+            size_t window = static_cast<size_t>(std::max(policy.segment_parallelism, 1)) * 4;
+            std::vector<size_t> missing;
+
+            for (size_t next = index; next <= last && missing.size() < window; next++) {
+                if (next == index || !store_segments || !cache.get(CacheSpace::SegmentKey(key, manifest->generation, next))) {
+                    missing.push_back(next);
+                }
+            }
+
+            auto segments = FetchSegments(route, key, target, *manifest, missing, store_segments);
+            fetched.clear();
+
+            for (size_t i = 0; i < missing.size(); i++) {
+                fetched[missing[i]] = segments[i];
+            }
+
+            segment = fetched[index];
+
+            if (!segment) {
+                LogMessage(LogLevel::Warn, "Failed to fetch segment " + std::to_string(index) + " of " + target);
+                return false;
+            }
+        }
+
+        size_t segment_start = index * segment_size;
+        size_t from = std::max(offset, segment_start) - segment_start;
+        size_t to = std::min(end - segment_start, segment->body.size());
+
+        if (from >= to || !sink.write(segment->body.data() + from, to - from)) {
+            return false;
         }
-        while (cache.CheckHeapTop()) {}
     }
+
+    return true;
 }
 
-void ProxySpace::Proxy::StartServer() {
-    ttl_thread = std::thread(&ProxySpace::Proxy::TTLFunction, this);
+// The segments are split into segment_parallelism parts, each taking every n-th segment over
+// a pooled client, so the origin sees at most that many connections per response. The parts
+// run as tasks of this proxy's group, and the caller takes on any part no worker has started
+// yet, so a round never waits behind workers that are all busy. A failed segment comes back
+// as nullptr.
+std::vector<std::shared_ptr<CacheSpace::CachedResponse>> ProxySpace::Proxy::FetchSegments(
+    const Route &route,
+    const std::string &key,
+    const std::string &target,
+    const CacheSpace::CachedResponse &manifest,
+    const std::vector<size_t> &indices,
+    bool store_segments
+) {
+    std::vector<std::shared_ptr<CacheSpace::CachedResponse>> segments(indices.size());
+    size_t workers = std::min<size_t>(std::max(route.policy.segment_parallelism, 1), indices.size());
+
+    // If-Range makes the origin answer 200 instead of 206 if the object changed underneath us.
+    std::string validator;
+    auto etag_it = manifest.headers.find("ETag");
+    auto last_modified_it = manifest.headers.find("Last-Modified");
+
+    if (etag_it != manifest.headers.end() && !etag_it->second.starts_with("W/")) {
+        validator = etag_it->second;
+    } else if (last_modified_it != manifest.headers.end()) {
+        validator = last_modified_it->second;
+    }
 
-    svr.Get("/.*", [&](const httplib::Request &req, httplib::Response &res) {
-        HandleRequest(req, res);
-    });
+    const auto fetch_every_nth = [&](size_t first) {
+        HttpClient client = AcquireClient(route.origin);
+
+        for (size_t i = first; i < indices.size(); i += workers) {
+            size_t start = indices[i] * manifest.segment_size;
+            size_t expected = std::min(manifest.segment_size, manifest.object_size - start);
+            httplib::Headers headers;
+            headers.insert({"Range", "bytes=" + std::to_string(start) + "-" + std::to_string(start + expected - 1)});
+            headers.insert({"Accept-Encoding", "identity"});
+
+            if (!validator.empty()) {
+                headers.insert({"If-Range", validator});
+            }
+
+            InFlight in_flight(origin_in_flight);
+            auto origin_res = client->Get(target.c_str(), headers);
+
+            if (!origin_res || origin_res->status != 206 || origin_res->body.size() != expected) {
+                break;
+            }
+
+            auto segment = std::make_shared<CacheSpace::CachedResponse>();
+            segment->status = 206;
+            segment->expires_at = manifest.ExpiresAt();
+            segment->body = std::move(origin_res->body);
+
+            if (store_segments) {
+                cache.put(CacheSpace::SegmentKey(key, manifest.generation, indices[i]), *segment);
+            }
+
+            segments[i] = std::move(segment);
+        }
 
-    svr.new_task_queue = [] {
-        return new httplib::ThreadPool(std::max(std::thread::hardware_concurrency(), 4u), 100);
+        ReleaseClient(route.origin, std::move(client));
     };
 
-    svr.set_payload_max_length(1 * 1024 * 1024);
-    bool started = svr.listen("localhost", config.port);
+    // Outlives the call, as queued parts may only run (and find nothing left to do) later.
+    struct Round {
+        std::mutex mtx;
+        std::condition_variable done_cv;
+        std::vector<int> parts; // 0 waiting, 1 running, 2 done
 
-    if (!started) {
-        std::cerr << "ERROR: Failed to bind to port " << config.port << ". It is likely being used by something else.\n";
-    }
-}
+        bool Claim(size_t part) {
+            std::lock_guard lock(mtx);
+            return parts[part] == 0 ? (parts[part] = 1, true) : false;
+        }
+
+        void Finish(size_t part) {
+            {
+                std::lock_guard lock(mtx);
+                parts[part] = 2;
+            }
 
-// It is possible for the max age to be 0.
-std::optional<int64_t> ProxySpace::Proxy::ParseMaxAge(const std::string& cache_control) {
-    LogMessage("Received cache control: " + cache_control);
-    std::stringstream ss(cache_control);
-    std::string directive;
+            done_cv.notify_all();
+        }
+    };
 
-    while (std::getline(ss, directive, ',')) {
-        // Trim whitespace
-        directive.erase(0, directive.find_first_not_of(" \t"));
-        directive.erase(directive.find_last_not_of(" \t") + 1);
+    auto round = std::make_shared<Round>();
+    round->parts.assign(workers, 0);
 
-        // Case-insensitive compare
-        std::string lower = directive;
-        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    const auto run = [this, &fetch_every_nth](Round& round, size_t part) {
+        try {
+            fetch_every_nth(part);
+        } catch (const std::exception& e) {
+            LogMessage(LogLevel::Error, std::string("Segment fetch failed: ") + e.what());
+        }
 
-        if (lower.rfind("max-age=", 0) == 0) {
-            try {
-                return std::stoll(lower.substr(8));
-            } catch (...) {
-                return std::nullopt;
+        round.Finish(part);
+    };
+
+    // A part that cannot be queued is simply left to the caller.
+    for (size_t part = 1; part < workers; part++) {
+        group->Submit([round, part, run = &run] {
+            if (round->Claim(part)) {
+                (*run)(*round, part);
             }
-        } else if (lower.rfind("no-store", 0) == 0) {
-            return 0;
-        } else if (lower.rfind("no-cache", 0) == 0) {
-            return -1;
+        });
+    }
+
+    for (size_t part = 0; part < workers; part++) {
+        if (round->Claim(part)) {
+            run(*round, part);
         }
     }
 
-    return std::nullopt;
+    std::unique_lock lock(round->mtx);
+    round->done_cv.wait(lock, [&] {
+        return std::all_of(round->parts.begin(), round->parts.end(), [](int state) { return state == 2; });
+    });
+
+    return segments;
 }
 
-std::string ProxySpace::Proxy::SelectOrigin(const std::string& path) const {
-    for (const auto& route : config.routes) {
-        if (path.rfind(route.prefix, 0) == 0) {
-            return route.origin;
+// RFC 9110 section 13.2.2: If-None-Match decides when present, otherwise If-Modified-Since does.
+bool ProxySpace::Proxy::IsNotModified(const httplib::Request &req, const CacheSpace::CachedResponse &cached) {
+    auto if_none_match = req.headers.find("If-None-Match");
+
+    if (if_none_match != req.headers.end()) {
+        auto etag_it = cached.headers.find("ETag");
+
+        if (etag_it == cached.headers.end()) {
+            return if_none_match->second == "*";
         }
+
+        // Weak comparison: the W/ prefix is ignored on both sides.
+        const auto opaque = [](std::string_view tag) {
+            tag = tag.substr(std::min(tag.find_first_not_of(" \t"), tag.size()));
+            return tag.starts_with("W/") ? tag.substr(2) : tag;
+        };
+        std::string_view etag = opaque(etag_it->second);
+        std::string_view candidates = if_none_match->second;
+
+        while (!candidates.empty()) {
+            size_t comma = candidates.find(',');
+            std::string_view candidate = opaque(candidates.substr(0, comma));
+            candidate = candidate.substr(0, candidate.find_last_not_of(" \t") + 1);
+
+            if (candidate == "*" || candidate == etag) {
+                return true;
+            }
+
+            candidates = comma == std::string_view::npos ? std::string_view{} : candidates.substr(comma + 1);
+        }
+
+        return false;
+    }
+
+    auto if_modified_since = req.headers.find("If-Modified-Since");
+    auto last_modified = cached.headers.find("Last-Modified");
+
+    if (if_modified_since == req.headers.end() || last_modified == cached.headers.end()) {
+        return false;
+    }
+
+    auto since = ParseHttpDate(if_modified_since->second);
+    auto modified = ParseHttpDate(last_modified->second);
+
+    return since && modified && *modified <= *since;
+}
+
+// If-Range only lets the range through when the client's copy is still the one we hold.
+bool ProxySpace::Proxy::RangeApplies(const httplib::Request &req, const CacheSpace::CachedResponse &cached) const {
+    auto if_range = req.headers.find("If-Range");
+
+    if (if_range == req.headers.end()) {
+        return true;
+    }
+
+    const std::string& validator = if_range->second;
+
+    if (validator.starts_with("\"")) {
+        auto etag = cached.headers.find("ETag");
+        return etag != cached.headers.end() && etag->second == validator;
+    }
+
+    auto last_modified = cached.headers.find("Last-Modified");
+    return last_modified != cached.headers.end() && last_modified->second == validator;
+}
+
+// At least one range has to overlap the body, otherwise the answer is 416.
+bool ProxySpace::Proxy::RangesSatisfiable(const httplib::Ranges &ranges, size_t length) {
+    for (const auto& [first, last] : ranges) {
+        if (first == -1 ? last > 0 : static_cast<size_t>(first) < length) {
+            return length > 0;
+        }
+    }
+
+    return false;
+}
+
+// XFetch: the closer an entry is to expiring, and the slower the origin was to produce it,
+// the more likely a hit is to renew it in the background. Hot keys get refreshed before they
+// expire, and the randomness keeps entries stored together from all expiring together.
+bool ProxySpace::Proxy::ShouldRefreshEarly(const CacheSpace::CachedResponse &cached, int64_t now) const {
+    if (config.early_refresh_beta <= 0.0 || cached.immutable) {
+        return false;
+    }
+
+    thread_local std::mt19937_64 rng{std::random_device{}()};
+    std::uniform_real_distribution<double> dist(std::numeric_limits<double>::min(), 1.0);
+    double delta = static_cast<double>(std::max<int64_t>(cached.fetch_latency_ms, 1));
+    double gap = -delta * config.early_refresh_beta * std::log(dist(rng));
+
+    return now + gap >= cached.ExpiresAt();
+}
+
+void ProxySpace::Proxy::ScheduleRefresh(const std::string &key, const httplib::Request &req) {
+    std::lock_guard lock(refresh_mtx);
+
+    // Only one refresh per key may be queued or running at a time.
+    if (!pending_refreshes.insert(key).second) {
+        return;
+    }
+
+    httplib::Request refresh_req;
+    refresh_req.method = req.method;
+    refresh_req.target = req.target;
+    refresh_req.path = req.path;
+    refresh_req.headers = req.headers;
+    refresh_queue.emplace(key, std::move(refresh_req));
+
+    // One drain task at a time, so background refreshes add at most one origin request.
+    if (!is_refreshing && !(is_refreshing = group->Submit([this] { DrainRefreshes(); }))) {
+        // The workers are saturated; the next stale hit asks again.
+        refresh_queue = {};
+        pending_refreshes.clear();
+    }
+}
+
+void ProxySpace::Proxy::DrainRefreshes() {
+    while (true) {
+        std::pair<std::string, httplib::Request> job;
+
+        {
+            std::lock_guard lock(refresh_mtx);
+
+            if (refresh_queue.empty() || !is_running) {
+                is_refreshing = false;
+                return;
+            }
+
+            job = std::move(refresh_queue.front());
+            refresh_queue.pop();
+        }
+
+        httplib::Response ignored;
+        FetchFromOrigin(SelectRoute(job.second.target), job.second, ignored);
+        if (Logger::Enabled(LogLevel::Debug)) {
+            LogMessage(LogLevel::Debug, "Refreshed " + job.first + " ahead of expiry");
+        }
+
+        std::lock_guard lock(refresh_mtx);
+        pending_refreshes.erase(job.first);
+    }
+}
+
+std::string ProxySpace::Proxy::MakeCacheKey(const Route& route, const httplib::Request& req) const {
+    std::string key = route.policy.key_normalizer.Normalize(req.target);
+
+    // A key that routes elsewhere could serve this origin's response for another route's
+    // resource, so such a request is cached under its exact target instead.
+    if (key != req.target && &SelectRoute(key) != &route) {
+        Logger::Log(LogLevel::Warn, config.port, "Cache key " + key + " of " + req.target + " belongs to another route; not normalizing it");
+        return req.target;
+    }
+
+    return key;
+}
+
+// The header names of a Vary value, lowercased and sorted so that equivalent lists compare equal.
+std::vector<std::string> ProxySpace::Proxy::ParseVary(const std::string& vary_spec) {
+    std::vector<std::string> vary;
+    std::stringstream ss(vary_spec);
+    std::string header_name;
+
+    while (std::getline(ss, header_name, ',')) {
+        header_name.erase(0, header_name.find_first_not_of(" \t"));
+        header_name.erase(header_name.find_last_not_of(" \t") + 1);
+        std::transform(header_name.begin(), header_name.end(), header_name.begin(), ::tolower);
+
+        // The proxy picks the encoding with the origin and with each client itself, so
+        // entries never differ by the client's Accept-Encoding.
+        if (header_name.empty() || header_name == "accept-encoding") {
+            continue;
+        }
+
+        vary.push_back(header_name);
+    }
+
+    std::sort(vary.begin(), vary.end());
+    vary.erase(std::unique(vary.begin(), vary.end()), vary.end());
+
+    return vary;
+}
+
+// The value of a request header as far as Vary is concerned: its bucket when the route
+// normalizes the header, otherwise the raw value. Missing headers have no value. header_name
+// is lowercase, as ParseVary leaves it.
+std::optional<std::string_view> ProxySpace::Proxy::NormalizedValue(const RoutePolicy& policy, const std::string& header_name, const httplib::Request& req) {
+    auto hdr_it = req.headers.find(header_name);
+    std::optional<std::string_view> value;
+
+    if (hdr_it != req.headers.end()) {
+        value = hdr_it->second;
+    }
+
+    if (!policy.vary_languages.empty() && header_name == "accept-language") {
+        return LanguageBucket(value.value_or(""), policy.vary_languages);
+    }
+
+    if (policy.vary_device_class && header_name == "user-agent") {
+        return DeviceClass(value.value_or(""));
+    }
+
+    return value;
+}
+
+// FNV-1a over the request's values of the vary headers. A missing header hashes differently
+// from an empty one. 0 is kept for responses that do not vary.
+uint64_t ProxySpace::Proxy::VariantHash(const RoutePolicy& policy, const httplib::Request& req, const std::vector<std::string>& vary) {
+    if (vary.empty()) {
+        return 0;
+    }
+
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](std::string_view bytes) {
+        for (unsigned char c : bytes) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+    };
+
+    for (const auto& header_name : vary) {
+        auto value = NormalizedValue(policy, header_name, req);
+        mix(header_name);
+        mix(value ? std::string_view("=") : std::string_view("\x01"));
+
+        if (value) {
+            mix(*value);
+        }
+
+        mix("\n");
+    }
+
+    return hash != 0 ? hash : 1;
+}
+
+void ProxySpace::Proxy::HandleRequest(const httplib::Request &req, httplib::Response &res, const EarlyLookup *early) {
+    if (MatchesEndpoint(req.path, req, res)) {
+        return;
+    }
+
+    // Would make cache keys ambiguous, see CacheSpace::SegmentKey.
+    if (req.target.find('\0') != std::string::npos) {
+        res.status = 400;
+        res.set_content("Bad request target", "text/plain");
+        return;
+    }
+
+    int64_t start = early ? early->start_us : NowMicros();
+    trace = {};
+
+    const Route& route = SelectRoute(req.target);
+    std::string url = MakeCacheKey(route, req);
+    int64_t key_built = early ? early->key_built_us : NowMicros();
+
+    if (!early && Logger::Enabled(LogLevel::Debug)) {
+        LogMessage(LogLevel::Debug, "Received request for " + url);
+    }
+
+    CacheSpace::Lookup lookup;
+
+    if (early) {
+        lookup = early->lookup;
+        trace.cache_lookup_us = early->cache_lookup_us;
+    } else {
+        lookup = LookUp(route, url, req);
+    }
+
+    Respond(route, url, lookup, req, res);
+    FinishRequest(route, url, res, start, key_built);
+}
+
+// Answers fresh hits held in memory, which need neither an origin nor a decompression. Anything
+// else returns false, with the lookup made so far in early for HandleRequest to pick up.
+bool ProxySpace::Proxy::TryServeHit(const httplib::Request &req, httplib::Response &res, EarlyLookup &early) {
+    early.start_us = NowMicros();
+
+    if (endpoints.contains(req.path) || req.target.find('\0') != std::string::npos) {
+        return false;
+    }
+
+    trace = {};
+
+    const Route& route = SelectRoute(req.target);
+    std::string url = MakeCacheKey(route, req);
+    early.key_built_us = NowMicros();
+
+    if (Logger::Enabled(LogLevel::Debug)) {
+        LogMessage(LogLevel::Debug, "Received request for " + url);
+    }
+
+    early.lookup = LookUp(route, url, req);
+    early.cache_lookup_us = trace.cache_lookup_us;
+
+    const auto& [key, cached] = early.lookup;
+    int64_t now = cache.GetCurrentMillis();
+
+    if (!cached || cached->ExpiresAt() <= now || cached->IsSegmented()) {
+        return false;
+    }
+
+    auto encoding_it = cached->headers.find("Content-Encoding");
+
+    if (encoding_it != cached->headers.end() && encoding_it->second == "gzip" && !CacheSpace::AcceptsEncoding(req, "gzip")) {
+        return false;
+    }
+
+    // Served here rather than through Respond, which would look at the expiry again and could
+    // find the entry expired since, sending the loop thread to the origin to revalidate it.
+    ServeFresh(route, key, cached, req, res, now);
+    cache.LogEvent(url, true);
+    FinishRequest(route, url, res, early.start_us, early.key_built_us);
+
+    return true;
+}
+
+// Records a proxied request in the route's metrics and the access log.
+void ProxySpace::Proxy::FinishRequest(const Route &route, const std::string &url, const httplib::Response &res, int64_t start, int64_t key_built) {
+    int64_t end = NowMicros();
+    size_t bytes = res.content_length_ ? res.content_length_ : res.body.size();
+    route.metrics->latency[static_cast<size_t>(trace.outcome)].Record(end - start);
+    route.metrics->bytes_served.Add(bytes);
+
+    if (trace.origin_start_us && trace.origin_headers_us) {
+        route.metrics->origin_latency.Record(trace.origin_headers_us - trace.origin_start_us);
+    }
+
+    if (!access_log) {
+        return;
+    }
+
+    AccessRecord record;
+    record.timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count() - (end - start) / 1000;
+    record.port = config.port;
+    record.route = route.prefix;
+    record.key_hash = CacheSpace::ContentHash(url);
+    record.outcome = trace.outcome;
+    record.status = res.status;
+    record.bytes = bytes;
+    record.key_build_us = key_built - start;
+    record.cache_lookup_us = trace.cache_lookup_us;
+
+    if (trace.origin_start_us) {
+        int64_t sent = std::max(trace.origin_start_us, trace.origin_connected_us);
+        record.origin_connect_us = trace.origin_connected_us ? std::max<int64_t>(trace.origin_connected_us - trace.origin_start_us, 0) : 0;
+        record.origin_ttfb_us = trace.origin_headers_us ? std::max<int64_t>(trace.origin_headers_us - sent, 0) : 0;
+    }
+
+    record.total_us = end - start;
+    access_log->Write(std::move(record));
+}
+
+// Answers from the cache when it can and from the origin otherwise.
+void ProxySpace::Proxy::Respond(const Route &route, const std::string &url, const CacheSpace::Lookup &lookup, const httplib::Request &req, httplib::Response &res) {
+    if (CheckCacheForResponse(route, lookup, req, res)) {
+        cache.LogEvent(url, true);
+        return;
+    }
+
+    auto storage_key = FetchFromOrigin(route, req, res);
+
+    if (storage_key) {
+        cache.LogEvent(url, false);
+    } else if (res.status >= 500 && ServeStaleOnError(route, url, req, res)) {
+        return;
+    }
+
+    // The origin was asked for the whole body so that it can be cached; cut the range out of it here.
+    if (res.status == 200 && !req.ranges.empty() && !res.body.empty()) {
+        if (!RangesSatisfiable(req.ranges, res.body.size())) {
+            res.headers.insert({"Content-Range", "bytes */" + std::to_string(res.body.size())});
+            res.status = 416;
+            res.body.clear();
+        } else {
+            res.headers.erase("Content-Length");
+            res.status = 206;
+        }
+    }
+}
+
+// Fetches req.target from its origin into res and caches it when allowed.
+// Returns the key the response was stored under, if it was stored.
+std::optional<std::string> ProxySpace::Proxy::FetchFromOrigin(const Route &route, const httplib::Request &req, httplib::Response &res) {
+    const RoutePolicy& policy = route.policy;
+    auto cli = route.client;
+    httplib::Headers headers;
+    headers.insert({"Host", std::string(OriginHost(route.origin))});
+    headers.insert({"Connection", "close"});
+
+    if (Logger::Enabled(LogLevel::Debug)) {
+        LogMessage(LogLevel::Debug, "Selected origin: " + route.origin + " for request path: " + req.target);
+    }
+
+    std::string body;
+    bool too_large = false;
+    std::optional<httplib::Response> large_object; // status and headers only
+    auto fetch_start = std::chrono::steady_clock::now();
+
+    // Forward what variants are selected by. Accept-Language goes out as its bucket, which is
+    // what the response is stored under; User-Agent as sent, since origins look at all of it.
+    if (auto language = NormalizedValue(policy, "accept-language", req); language && !language->empty()) {
+        headers.insert({"Accept-Language", std::string(*language)});
+    }
+
+    if (req.has_header("User-Agent")) {
+        headers.insert({"User-Agent", req.get_header_value("User-Agent")});
+    }
+
+    const auto fetch = [&](bool compressed) {
+        httplib::Headers fetch_headers = headers;
+        fetch_headers.insert({"Accept-Encoding", compressed ? "gzip" : "identity"});
+        trace.origin_start_us = NowMicros();
+        InFlight in_flight(origin_in_flight);
+
+        return cli->Get(
+            req.target.c_str(),
+            fetch_headers,
+            [&](const httplib::Response& response) {
+                trace.origin_headers_us = NowMicros();
+
+                // Objects that announce a body too big to hold in one piece are fetched again in
+                // segments, provided the origin says it serves byte ranges of them. Origins that
+                // don't say so may answer Range requests with the whole body.
+                size_t length = response.get_header_value_u64("Content-Length");
+
+                if (response.status == 200 && length > policy.max_response_size && length <= policy.max_object_size
+                    && AcceptsByteRanges(response)) {
+                    large_object = response;
+                    return false;
+                }
+
+                return true;
+            },
+            [&](const char* data, size_t length) {
+                if (body.size() + length > policy.max_response_size) {
+                    too_large = true;
+                    return false;
+                }
+
+                body.append(data, length);
+                return true;
+            }
+        );
+    };
+
+    auto origin_res = fetch(policy.upstream_encoding == "gzip");
+
+    // Segments are requested as identity ranges, so large objects are described by their identity length.
+    if (large_object && large_object->has_header("Content-Encoding")) {
+        large_object.reset();
+        origin_res = fetch(false);
+
+        // An origin that keeps encoding it can be served neither whole nor in segments.
+        if (large_object && large_object->has_header("Content-Encoding")) {
+            large_object.reset();
+            too_large = true;
+        }
+    }
+
+    auto fetch_latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - fetch_start
+    );
+
+    if (too_large) {
+        res.status = 413;
+        res.set_content("Origin response too large", "text/plain");
+        return std::nullopt;
+    }
+
+    if (!origin_res && !large_object) {
+        std::string error_msg = "Proxy error: " + httplib::to_string(origin_res.error());
+        res.status = 502;
+        res.set_content(error_msg, "text/plain");
+        return std::nullopt;
+    }
+
+    const httplib::Response& origin = large_object ? *large_object : *origin_res;
+    auto cache_it = origin.headers.find("Cache-Control");
+    CacheControl cache_control = cache_it != origin.headers.end() ? ParseCacheControl(cache_it->second) : CacheControl{};
+
+    res.status = origin.status;
+    res.headers.clear();
+    httplib::Headers filtered_headers;
+
+    for (const auto& [hdr, value] : origin.headers) {
+        std::string lower = hdr;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+        if (!ProxySpace::hop_by_hop.contains(lower)) {
+            filtered_headers.insert({hdr, value});
+        }
+    }
+
+    res.headers = filtered_headers;
+    res.headers.insert({"X-Cache", "MISS"});
+    int64_t now = cache.GetCurrentMillis();
+    int64_t to_add = FreshnessMillis(origin.status, cache_control, origin.headers, policy, fetch_latency.count());
+
+    // Errors are only kept when the origin explicitly asked for it, so that they never
+    // replace an entry that stale-if-error could still serve.
+    if (origin.status >= 500 && !cache_control.SharedMaxAge() && !origin.headers.contains("Expires")) {
+        to_add = 0;
+    }
+
+    std::vector<std::string> vary;
+    auto vary_it = origin.headers.find("Vary");
+
+    if (vary_it != origin.headers.end()) {
+        vary = ParseVary(vary_it->second);
+
+        // "Vary: *" can never be matched by a later request.
+        if (std::find(vary.begin(), vary.end(), "*") != vary.end()) {
+            to_add = 0;
+        }
+    }
+
+    std::string url = MakeCacheKey(route, req);
+    uint64_t variant = VariantHash(policy, req, vary);
+    std::string storage_key = CacheSpace::VariantKey(url, variant);
+
+    CacheSpace::CachedResponse cached;
+    cached.status = origin.status;
+    cached.body = std::move(body);
+    cached.headers = filtered_headers;
+    cached.expires_at = (to_add < 0) ? now : now + to_add;
+    cached.fetch_latency_ms = fetch_latency.count();
+    cached.generation = cache.NextGeneration();
+    cached.immutable = cache_control.immutable;
+
+    if (auto etag_it = cached.headers.find("ETag"); etag_it != cached.headers.end()) {
+        cached.origin_etag = etag_it->second;
+    }
+
+    if (!cache_control.MustRevalidate()) {
+        cached.stale_while_revalidate_ms = cache_control.stale_while_revalidate.value_or(0) * 1000;
+        cached.stale_if_error_ms = cache_control.stale_if_error.value_or(0) * 1000;
+    }
+
+    bool store = to_add != 0;
+
+    if (large_object) {
+        cached.object_size = large_object->get_header_value_u64("Content-Length");
+        cached.segment_size = policy.segment_size;
+
+        // Capacity counts entries and every segment is one, so an object that would take more
+        // than a quarter of the cache is passed through instead of evicting everything else,
+        // and its own first segments, on the way in.
+        constexpr size_t MAX_SEGMENT_SHARE = 4;
+        size_t segments = (cached.object_size + cached.segment_size - 1) / cached.segment_size;
+
+        if (store && segments * MAX_SEGMENT_SHARE > static_cast<size_t>(cache.GetCapacity())) {
+            store = false;
+
+            if (Logger::Enabled(LogLevel::Debug)) {
+                LogMessage(LogLevel::Debug, "Not caching " + url + ": " + std::to_string(segments) + " segments is too many for the cache");
+            }
+        }
+
+        ServeCached(route, storage_key, std::make_shared<CacheSpace::CachedResponse>(cached), req, res, store);
+        res.headers.insert({"X-Cache", "MISS"});
+    }
+
+    if (to_add == 0) {
+        res.body = std::move(cached.body);
+        cache.IncrementCompliantMisses();
+
+        // gzip was asked for on the cache's behalf, so a client that did not ask for it gets the
+        // body decoded, as ServeCached does for stored entries. Large objects are always identity.
+        auto encoding_it = res.headers.find("Content-Encoding");
+        bool is_gzip = !large_object && encoding_it != res.headers.end() && encoding_it->second == "gzip";
+
+        if (is_gzip && res.get_header_value("Vary").find("Accept-Encoding") == std::string::npos) {
+            res.headers.insert({"Vary", "Accept-Encoding"});
+        }
+
+        if (is_gzip && !CacheSpace::AcceptsEncoding(req, "gzip")) {
+            auto decoded = CacheSpace::GzipDecompress(res.body, std::max(policy.max_response_size, policy.max_object_size));
+
+            if (!decoded) {
+                res = httplib::Response();
+                res.status = 502;
+                res.set_content("Proxy error: could not decode origin response", "text/plain");
+                return std::nullopt;
+            }
+
+            res.body = std::move(*decoded);
+            res.headers.erase("Content-Encoding");
+
+            if (auto etag_it = res.headers.find("ETag"); etag_it != res.headers.end()) {
+                etag_it->second = CacheSpace::EncodingETag(etag_it->second, "identity");
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    if (!store) {
+        return std::nullopt;
+    }
+
+    if (!large_object) {
+        cached.content_hash = CacheSpace::ContentHash(cached.body);
+
+        if (!cached.headers.contains("ETag")) {
+            cached.headers.insert({"ETag", CacheSpace::SynthesizedETag(cached.content_hash)});
+        }
+
+        // Unchanged content keeps its entry (and its compressed body); only the expiry moves.
+        auto existing = cache.get(storage_key);
+
+        if (existing && !existing->IsSegmented() && existing->status == cached.status
+            && existing->content_hash == cached.content_hash
+            && cache.Renew(storage_key, existing->generation, cached.expires_at)) {
+            ServeCached(route, storage_key, existing, req, res);
+            res.headers.erase("X-Cache");
+            res.headers.insert({"X-Cache", "MISS"});
+
+            return storage_key;
+        }
+
+        CompressForStorage(cached, policy);
+    }
+
+    cached.headers.insert({"X-Cache", "HIT"});
+    auto stored = std::make_shared<CacheSpace::CachedResponse>(std::move(cached));
+    cache.Store(url, vary, variant, stored);
+
+    if (!large_object) {
+        ServeCached(route, storage_key, stored, req, res);
+        res.headers.erase("X-Cache");
+        res.headers.insert({"X-Cache", "MISS"});
+    }
+
+    return storage_key;
+}
+
+// Runs on the shared runtime and re-arms itself for the next expiry. Lookups already treat
+// expired entries as stale, so running late only delays freeing them.
+void ProxySpace::Proxy::ExpireEntries() {
+    while (cache.CheckHeapTop()) {}
+    while (decompressed_cache.CheckHeapTop()) {}
+
+    if (config.capacity_tuning.Enabled() && cache.GetCurrentMillis() >= next_tune_ms) {
+        TuneCapacity();
+        next_tune_ms = cache.GetCurrentMillis() + config.capacity_tuning.interval_ms;
+    }
+
+    group->After(std::min(cache.MillisUntilNextExpiry(), decompressed_cache.MillisUntilNextExpiry()), [this] { ExpireEntries(); });
+}
+
+// Doubles the cache when the estimates say that pays off and halves it when it would barely
+// be missed, within the configured sizes. The estimator starts over after every change.
+void ProxySpace::Proxy::TuneCapacity() {
+    const CapacityTuning& tuning = config.capacity_tuning;
+    auto curve = cache.EstimateHitRatios();
+
+    if (!curve.warm) {
+        return;
+    }
+
+    // SCALES are 0.5x, 1x, 2x and 4x.
+    double half = curve.points[0].hit_ratio;
+    double current = curve.points[1].hit_ratio;
+    double twice = curve.points[2].hit_ratio;
+    int capacity = cache.GetCapacity();
+    int target = capacity;
+
+    if (twice - current >= tuning.min_gain && capacity < tuning.max_size) {
+        target = std::min(capacity * 2, tuning.max_size);
+        int64_t entries = cache.Size();
+
+        // Keeps the grown cache under max_bytes, going by the average size of what is cached now.
+        if (tuning.max_bytes > 0 && entries > 0) {
+            double entry_bytes = static_cast<double>(cache.Bytes()) / entries;
+
+            if (entry_bytes > 0 && entry_bytes * target > tuning.max_bytes) {
+                target = std::max(capacity, static_cast<int>(tuning.max_bytes / entry_bytes));
+            }
+        }
+    } else if (current - half < tuning.min_gain / 10 && capacity > tuning.min_size) {
+        target = std::max(capacity / 2, tuning.min_size);
+    }
+
+    if (target == capacity) {
+        return;
+    }
+
+    cache.SetCapacity(target);
+    LogMessage(LogLevel::Info, "Cache size changed from " + std::to_string(capacity) + " to " + std::to_string(target)
+        + " (estimated hit ratio " + std::to_string(half) + " at 0.5x, " + std::to_string(current) + " now, "
+        + std::to_string(twice) + " at 2x)");
+}
+
+void ProxySpace::Proxy::StartServer() {
+    next_tune_ms = cache.GetCurrentMillis() + config.capacity_tuning.interval_ms;
+    group->After(cache.MillisUntilNextExpiry(), [this] { ExpireEntries(); });
+
+    constexpr size_t max_payload = 1 * 1024 * 1024;
+
+#ifdef __linux__
+    // Hits are answered on the loop thread; anything else goes to a worker with the lookup
+    // already done.
+    if (config.front_end == "epoll") {
+        event_server = std::make_unique<EventServer>(group, [this](const httplib::Request& req, httplib::Response& res) -> EventServer::Deferred {
+            EarlyLookup early;
+
+            if (TryServeHit(req, res, early)) {
+                return nullptr;
+            }
+
+            return [this, early = std::move(early)](const httplib::Request& req, httplib::Response& res) {
+                HandleRequest(req, res, &early);
+            };
+        }, max_payload);
+
+        if (!event_server->Listen("localhost", config.port)) {
+            std::cerr << "ERROR: Failed to bind to port " << config.port << ". It is likely being used by something else.\n";
+        }
+
+        return;
+    }
+#endif
+
+    svr.Get("/.*", [&](const httplib::Request &req, httplib::Response &res) {
+        HandleRequest(req, res);
+    });
+
+    // Connections are served by the workers shared with the other proxies, see Runtime.
+    svr.new_task_queue = [this] { return new RuntimeTaskQueue(group); };
+
+    svr.set_payload_max_length(max_payload);
+    svr.set_tcp_nodelay(true); // headers and provided bodies are separate writes; don't wait on delayed ACKs
+    bool started = svr.listen("localhost", config.port);
+
+    if (!started) {
+        std::cerr << "ERROR: Failed to bind to port " << config.port << ". It is likely being used by something else.\n";
+    }
+}
+
+namespace {
+    // RFC 9111 section 4.2.2: only these may be given a heuristic lifetime.
+    bool IsHeuristicallyCacheable(int status) {
+        switch (status) {
+            case 200: case 203: case 204: case 206: case 300: case 301: case 308:
+            case 404: case 405: case 410: case 414: case 501:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    std::optional<int64_t> HeaderDate(const httplib::Headers& headers, const char* name) {
+        auto it = headers.find(name);
+        return it != headers.end() ? ProxySpace::ParseHttpDate(it->second) : std::nullopt;
+    }
+}
+
+// Milliseconds the response stays fresh from now on: its freshness lifetime minus the age it
+// already had on arrival (RFC 9111 sections 4.2.1 and 4.2.3). 0 when it must not be stored at
+// all, -1 when it may be stored but has to be revalidated before every use.
+int64_t ProxySpace::Proxy::FreshnessMillis(int status, const CacheControl& cache_control, const httplib::Headers& headers, const RoutePolicy& policy, int64_t response_delay_ms) {
+    if (cache_control.no_store || cache_control.is_private) {
+        return 0;
+    }
+
+    if (cache_control.no_cache) {
+        return -1;
+    }
+
+    int64_t response_time = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count();
+    int64_t date = HeaderDate(headers, "Date").value_or(response_time);
+    int64_t lifetime_ms = 0;
+
+    if (auto max_age = cache_control.SharedMaxAge()) {
+        // It is possible for the max age to be 0, which keeps the response out of the cache.
+        if (*max_age == 0) {
+            return 0;
+        }
+
+        lifetime_ms = *max_age * 1000;
+    } else if (headers.contains("Expires")) {
+        // An Expires that does not parse (often "0" or "-1") means already expired.
+        auto expires = HeaderDate(headers, "Expires");
+        lifetime_ms = expires ? (*expires - date) * 1000 : 0;
+    } else if (auto last_modified = HeaderDate(headers, "Last-Modified"); last_modified && *last_modified < date) {
+        if (!IsHeuristicallyCacheable(status)) {
+            return policy.ttl_ms;
+        }
+
+        lifetime_ms = std::min<int64_t>(
+            std::llround(static_cast<double>(date - *last_modified) * 1000.0 * policy.heuristic_fraction),
+            policy.heuristic_max_ttl_ms
+        );
+    } else {
+        return policy.ttl_ms;
+    }
+
+    // The age the response had when it got here: what the clocks say, or what the Age header
+    // plus our own round trip say, whichever is larger.
+    int64_t apparent_age_ms = std::max<int64_t>(0, response_time - date) * 1000;
+    int64_t age_value_ms = 0;
+    auto age_it = headers.find("Age");
+
+    if (age_it != headers.end()) {
+        int64_t age = 0;
+        auto [ptr, ec] = std::from_chars(age_it->second.data(), age_it->second.data() + age_it->second.size(), age);
+
+        if (ec == std::errc{} && age > 0) {
+            age_value_ms = std::min<int64_t>(age, int64_t{1} << 31) * 1000;
+        }
+    }
+
+    int64_t initial_age_ms = std::max(apparent_age_ms, age_value_ms + response_delay_ms);
+    int64_t remaining_ms = lifetime_ms - initial_age_ms;
+
+    return remaining_ms > 0 ? remaining_ms : -1;
+}
+
+const ProxySpace::Route& ProxySpace::Proxy::SelectRoute(const std::string& path) const {
+    size_t escape = path.find('%');
+
+    // The default route has the empty prefix, so there is always a match.
+    if (escape == std::string::npos || escape > path.find('?')) {
+        return **route_trie.LongestPrefixMatch(path);
     }
 
-    return config.origin_url; // default
+    // With decode-percent on, /%77iki/x is keyed as /wiki/x, so it has to be routed as /wiki/x too.
+    return **route_trie.LongestPrefixMatch(KeyNormalizer::DecodedPath(path));
 }
\ No newline at end of file
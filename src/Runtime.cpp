@@ -0,0 +1,309 @@
+#include "Runtime.hpp"
+#include "Logger.hpp"
+#include <algorithm>
+
+namespace {
+    // Lets Submit tell a worker of this runtime, which pushes onto its own deque, from any other thread.
+    thread_local ProxySpace::Runtime* current_runtime = nullptr;
+    thread_local size_t current_worker = 0;
+}
+
+std::atomic<size_t> ProxySpace::Runtime::configured_threads{0};
+
+ProxySpace::Runtime::Group::Group(Runtime& runtime, int port, int weight, size_t max_queued) :
+    runtime(runtime), port(port), weight(std::max(weight, 1)), stride(STRIDE_BASE / this->weight), max_queued(max_queued) {}
+
+bool ProxySpace::Runtime::Group::Submit(std::function<void()> fn) {
+    return runtime.Push(shared_from_this(), std::move(fn), true);
+}
+
+void ProxySpace::Runtime::Group::After(int64_t delay_ms, std::function<void()> fn) {
+    if (!is_open) {
+        return;
+    }
+
+    std::lock_guard lock(runtime.timer_mtx);
+    auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max<int64_t>(delay_ms, 0));
+    bool earliest = runtime.timers.empty() || due < runtime.timers.top().due;
+    runtime.timers.push({due, runtime.timer_sequence++, shared_from_this(), std::move(fn)});
+
+    if (earliest) {
+        runtime.timer_cv.notify_one();
+    }
+}
+
+// Pending timers are not waited for; they find the group closed when they fire.
+void ProxySpace::Runtime::Group::Shutdown() {
+    if (is_open.exchange(false)) {
+        std::lock_guard lock(runtime.mtx);
+        runtime.total_weight -= weight;
+    }
+
+    std::unique_lock lock(drain_mtx);
+    drain_cv.wait(lock, [this] { return outstanding.load() == 0; });
+}
+
+void ProxySpace::Runtime::Configure(size_t threads) {
+    configured_threads = threads;
+}
+
+// Twice the cores by default: workers block on origin fetches and on idle keep-alive
+// connections, so a worker per core would leave cores idle.
+ProxySpace::Runtime& ProxySpace::Runtime::Instance() {
+    static Runtime runtime(configured_threads.load() > 0 ? configured_threads.load() : std::max(std::thread::hardware_concurrency(), 4u) * 2);
+    return runtime;
+}
+
+ProxySpace::Runtime::Runtime(size_t threads) {
+    for (size_t i = 0; i < threads; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+
+    // Every deque exists before any worker may try to steal from it.
+    for (size_t i = 0; i < threads; i++) {
+        workers[i]->thread = std::thread(&ProxySpace::Runtime::WorkerFunction, this, i);
+    }
+
+    timer_thread = std::thread(&ProxySpace::Runtime::TimerFunction, this);
+}
+
+ProxySpace::Runtime::~Runtime() {
+    is_running = false;
+
+    {
+        std::lock_guard lock(mtx);
+        work_cv.notify_all();
+    }
+
+    {
+        std::lock_guard lock(timer_mtx);
+        timer_cv.notify_all();
+    }
+
+    for (auto& worker : workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+
+    if (timer_thread.joinable()) {
+        timer_thread.join();
+    }
+}
+
+std::shared_ptr<ProxySpace::Runtime::Group> ProxySpace::Runtime::CreateGroup(int port, int weight, size_t max_queued) {
+    auto group = std::shared_ptr<Group>(new Group(*this, port, weight, max_queued));
+
+    std::lock_guard lock(mtx);
+    total_weight += group->weight;
+
+    return group;
+}
+
+bool ProxySpace::Runtime::Push(const std::shared_ptr<Group>& group, std::function<void()> fn, bool bounded) {
+    if (bounded && static_cast<size_t>(group->queued.load(std::memory_order_relaxed)) >= group->max_queued) {
+        return false;
+    }
+
+    // Counted before is_open is checked, so Shutdown either sees the task or the task sees the
+    // group closed.
+    group->outstanding++;
+
+    if (!group->is_open) {
+        if (--group->outstanding == 0) {
+            std::lock_guard lock(group->drain_mtx);
+            group->drain_cv.notify_all();
+        }
+
+        return false;
+    }
+
+    group->queued.fetch_add(1, std::memory_order_relaxed);
+
+    if (current_runtime == this) {
+        Worker& worker = *workers[current_worker];
+        std::lock_guard lock(worker.mtx);
+        worker.local.push_back({group, std::move(fn)});
+    } else {
+        std::lock_guard lock(mtx);
+
+        // A group that was idle starts at the current virtual time rather than with credit
+        // for the time it had nothing to run.
+        if (group->tasks.empty()) {
+            group->pass = std::max(group->pass, virtual_time);
+            active_groups.push_back(group);
+        }
+
+        group->tasks.push_back(std::move(fn));
+    }
+
+    pending++;
+
+    if (sleeping.load() > 0) {
+        std::lock_guard lock(mtx);
+        work_cv.notify_one();
+    }
+
+    return true;
+}
+
+// The workers a group may keep busy while other groups wait, rounded up and at least one.
+// Called with mtx held.
+int64_t ProxySpace::Runtime::Share(const Group& group) const {
+    int64_t threads = static_cast<int64_t>(workers.size());
+    int64_t total = std::max(total_weight, int64_t{group.weight});
+
+    return std::max<int64_t>((threads * group.weight + total - 1) / total, 1);
+}
+
+// Takes from the group with the lowest pass; each task taken advances the pass by the
+// group's stride, so groups are served in proportion to their weights. Groups running their
+// share are passed over for those that are not. When every group with work queued is at its
+// share, the others are idle and their workers are lent out rather than left asleep.
+bool ProxySpace::Runtime::PopGlobal(Task& task) {
+    std::lock_guard lock(mtx);
+
+    if (active_groups.empty()) {
+        return false;
+    }
+
+    auto by_pass = [](const auto& a, const auto& b) { return a->pass < b->pass; };
+    auto next = active_groups.end();
+
+    for (auto it = active_groups.begin(); it != active_groups.end(); ++it) {
+        if ((*it)->running.load(std::memory_order_relaxed) < Share(**it) && (next == active_groups.end() || by_pass(*it, *next))) {
+            next = it;
+        }
+    }
+
+    if (next == active_groups.end()) {
+        next = std::min_element(active_groups.begin(), active_groups.end(), by_pass);
+    }
+
+    auto group = *next;
+
+    task.group = group;
+    task.fn = std::move(group->tasks.front());
+    group->tasks.pop_front();
+    virtual_time = group->pass;
+    group->pass += group->stride;
+
+    // Counted while mtx is held, so the next worker to pop sees it against the share.
+    group->running.fetch_add(1, std::memory_order_relaxed);
+
+    if (group->tasks.empty()) {
+        *next = std::move(active_groups.back());
+        active_groups.pop_back();
+    }
+
+    pending--;
+    return true;
+}
+
+// The newest task first, while what it touches is likely still in this core's cache.
+bool ProxySpace::Runtime::PopLocal(size_t index, Task& task) {
+    Worker& worker = *workers[index];
+    std::lock_guard lock(worker.mtx);
+
+    if (worker.local.empty()) {
+        return false;
+    }
+
+    task = std::move(worker.local.back());
+    worker.local.pop_back();
+    task.group->running.fetch_add(1, std::memory_order_relaxed);
+    pending--;
+    return true;
+}
+
+// The oldest task of the first other worker that has one, starting with the next worker.
+bool ProxySpace::Runtime::Steal(size_t index, Task& task) {
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker& victim = *workers[(index + i) % workers.size()];
+        std::lock_guard lock(victim.mtx);
+
+        if (victim.local.empty()) {
+            continue;
+        }
+
+        task = std::move(victim.local.front());
+        victim.local.pop_front();
+        task.group->running.fetch_add(1, std::memory_order_relaxed);
+        pending--;
+        steals.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    return false;
+}
+
+void ProxySpace::Runtime::Run(Task& task) {
+    Group& group = *task.group;
+    group.queued.fetch_sub(1, std::memory_order_relaxed);
+
+    try {
+        task.fn();
+    } catch (const std::exception& e) {
+        Logger::Log(LogLevel::Error, group.port, std::string("Task failed: ") + e.what());
+    }
+
+    group.running.fetch_sub(1, std::memory_order_relaxed);
+
+    if (--group.outstanding == 0 && !group.is_open) {
+        std::lock_guard lock(group.drain_mtx);
+        group.drain_cv.notify_all();
+    }
+
+    task = {};
+}
+
+void ProxySpace::Runtime::WorkerFunction(size_t index) {
+    current_runtime = this;
+    current_worker = index;
+    uint64_t ticks = 0;
+    Task task;
+
+    while (true) {
+        // Every so often the groups go first, so a worker that keeps feeding its own deque
+        // cannot keep accepted connections waiting.
+        bool global_first = ++ticks % GLOBAL_CHECK_EVERY == 0;
+
+        if ((global_first && PopGlobal(task)) || PopLocal(index, task) || PopGlobal(task) || Steal(index, task)) {
+            Run(task);
+            continue;
+        }
+
+        std::unique_lock lock(mtx);
+        sleeping++;
+        work_cv.wait(lock, [this] { return pending.load() > 0 || !is_running; });
+        sleeping--;
+
+        if (!is_running && pending.load() <= 0) {
+            return;
+        }
+    }
+}
+
+void ProxySpace::Runtime::TimerFunction() {
+    std::unique_lock lock(timer_mtx);
+
+    while (is_running) {
+        if (timers.empty()) {
+            timer_cv.wait(lock);
+            continue;
+        }
+
+        if (std::chrono::steady_clock::now() < timers.top().due) {
+            timer_cv.wait_until(lock, timers.top().due);
+            continue;
+        }
+
+        Timer timer = timers.top();
+        timers.pop();
+        lock.unlock();
+
+        // Runs on a worker, so a slow callback never holds up the other timers.
+        Push(timer.group, std::move(timer.fn), false);
+        lock.lock();
+    }
+}
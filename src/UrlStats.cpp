@@ -0,0 +1,95 @@
+#include "UrlStats.hpp"
+#include <algorithm>
+#include <mutex>
+
+void CacheSpace::UrlStats::Record(const std::string& url, bool hit) {
+    Shard& shard = ShardFor(url);
+
+    {
+        std::shared_lock lock(shard.mtx);
+        auto it = shard.urls.find(url);
+
+        if (it != shard.urls.end()) {
+            (hit ? it->second.hits : it->second.misses).fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    std::unique_lock lock(shard.mtx);
+    Counts& counts = shard.urls[url];
+    (hit ? counts.hits : counts.misses).fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<CacheSpace::UrlCounts> CacheSpace::UrlStats::Query(const UrlStatsQuery& query) const {
+    // The order results are returned in: URL order, or most requested first with ties by URL.
+    auto precedes = [&query](const UrlCounts& a, const UrlCounts& b) {
+        if (query.top && a.Requests() != b.Requests()) {
+            return a.Requests() > b.Requests();
+        }
+
+        return a.url < b.url;
+    };
+
+    // Keeps the best `limit` entries seen so far in a heap whose front is the worst of them.
+    std::vector<UrlCounts> heap;
+
+    if (query.limit == 0) {
+        return heap;
+    }
+
+    heap.reserve(query.limit + 1);
+    UrlCounts candidate;
+
+    for (const Shard& shard : shards) {
+        std::shared_lock lock(shard.mtx);
+
+        for (const auto& [url, counts] : shard.urls) {
+            if (url.compare(0, query.prefix.size(), query.prefix) != 0) {
+                continue;
+            }
+
+            if (!query.top && !query.cursor.empty() && url <= query.cursor) {
+                continue;
+            }
+
+            candidate.url = url;
+            candidate.hits = counts.hits.load(std::memory_order_relaxed);
+            candidate.misses = counts.misses.load(std::memory_order_relaxed);
+
+            if (heap.size() == query.limit && !precedes(candidate, heap.front())) {
+                continue;
+            }
+
+            heap.push_back(std::move(candidate));
+            std::push_heap(heap.begin(), heap.end(), precedes);
+
+            if (heap.size() > query.limit) {
+                std::pop_heap(heap.begin(), heap.end(), precedes);
+                heap.pop_back();
+            }
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), precedes);
+
+    return heap;
+}
+
+bool CacheSpace::UrlStats::Empty() const {
+    for (const Shard& shard : shards) {
+        std::shared_lock lock(shard.mtx);
+
+        if (!shard.urls.empty()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void CacheSpace::UrlStats::Clear() {
+    for (Shard& shard : shards) {
+        std::unique_lock lock(shard.mtx);
+        shard.urls.clear();
+    }
+}
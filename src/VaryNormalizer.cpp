@@ -0,0 +1,109 @@
+#include "VaryNormalizer.hpp"
+#include <algorithm>
+#include <charconv>
+
+namespace {
+    std::string_view Trim(std::string_view s) {
+        size_t start = s.find_first_not_of(" \t");
+
+        if (start == std::string_view::npos) {
+            return {};
+        }
+
+        return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+    }
+
+    char ToLower(char c) {
+        return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+
+    bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return ToLower(x) == ToLower(y);
+        });
+    }
+
+    bool ContainsIgnoreCase(std::string_view haystack, std::string_view needle) {
+        return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(), [](char x, char y) {
+            return ToLower(x) == ToLower(y);
+        }) != haystack.end();
+    }
+
+    // q defaults to 1; anything unparsable counts as 0 so that it is never preferred.
+    double QValue(std::string_view params) {
+        params = Trim(params);
+
+        if (params.empty()) {
+            return 1.0;
+        }
+
+        if (!params.starts_with("q=") && !params.starts_with("Q=")) {
+            return 1.0;
+        }
+
+        double q = 0.0;
+        auto [ptr, ec] = std::from_chars(params.data() + 2, params.data() + params.size(), q);
+
+        return ec == std::errc{} ? q : 0.0;
+    }
+}
+
+std::string_view ProxySpace::LanguageBucket(std::string_view accept_language, const std::vector<std::string>& languages) {
+    std::string_view best;
+    double best_q = 0.0;
+
+    while (!accept_language.empty()) {
+        size_t comma = accept_language.find(',');
+        std::string_view item = Trim(accept_language.substr(0, comma));
+        accept_language = comma == std::string_view::npos ? std::string_view{} : accept_language.substr(comma + 1);
+
+        size_t semicolon = item.find(';');
+        std::string_view range = Trim(item.substr(0, semicolon));
+        double q = semicolon == std::string_view::npos ? 1.0 : QValue(item.substr(semicolon + 1));
+
+        // Ties go to the range listed first.
+        if (q <= best_q || languages.empty()) {
+            continue;
+        }
+
+        if (range == "*") {
+            best = languages.front();
+            best_q = q;
+            continue;
+        }
+
+        std::string_view primary = range.substr(0, range.find('-'));
+
+        for (const auto& language : languages) {
+            if (EqualsIgnoreCase(primary, language) || EqualsIgnoreCase(range, language)) {
+                best = language;
+                best_q = q;
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+std::string_view ProxySpace::DeviceClass(std::string_view user_agent) {
+    for (std::string_view marker : {"bot", "crawler", "spider", "slurp"}) {
+        if (ContainsIgnoreCase(user_agent, marker)) {
+            return "bot";
+        }
+    }
+
+    // Android tablets leave "Mobile" out of their User-Agent, phones include it.
+    if (ContainsIgnoreCase(user_agent, "ipad") || ContainsIgnoreCase(user_agent, "tablet")
+        || (ContainsIgnoreCase(user_agent, "android") && !ContainsIgnoreCase(user_agent, "mobile"))) {
+        return "tablet";
+    }
+
+    for (std::string_view marker : {"mobile", "iphone", "ipod", "android", "windows phone"}) {
+        if (ContainsIgnoreCase(user_agent, marker)) {
+            return "mobile";
+        }
+    }
+
+    return "desktop";
+}
@@ -1,8 +1,73 @@
 #include "httplib.h"
 #include "Proxy.hpp"
 #include <fstream>
+#include <cmath>
 #include <nlohmann/json.hpp>
 
+// Reads the per-route settings present in `value` on top of `policy`.
+static ProxySpace::RoutePolicy ParsePolicy(const nlohmann::json& value, ProxySpace::RoutePolicy policy) {
+    // "ttl" is in seconds but may be fractional, e.g. 0.25 for fast-changing endpoints.
+    if (value.contains("ttl")) {
+        policy.ttl_ms = std::llround(value["ttl"].get<double>() * 1000.0);
+    }
+
+    if (value.contains("heuristic-max-ttl")) {
+        policy.heuristic_max_ttl_ms = std::llround(value["heuristic-max-ttl"].get<double>() * 1000.0);
+    }
+
+    policy.heuristic_fraction = value.value("heuristic-fraction", policy.heuristic_fraction);
+    policy.max_response_size = value.value("max-response-size", policy.max_response_size);
+    policy.max_object_size = value.value("max-object-size", policy.max_object_size);
+    policy.segment_size = value.value("segment-size", policy.segment_size);
+    policy.segment_parallelism = value.value("segment-parallelism", policy.segment_parallelism);
+    policy.compress_in_cache = value.value("compress-in-cache", policy.compress_in_cache);
+    policy.compress_min_size = value.value("compress-min-size", policy.compress_min_size);
+
+    policy.upstream_encoding = value.value("upstream-encoding", policy.upstream_encoding);
+
+    // e.g. "vary-normalization": {"accept-language": ["en", "de"], "user-agent": true}
+    if (value.contains("vary-normalization")) {
+        const auto& vary = value["vary-normalization"];
+        policy.vary_languages = vary.value("accept-language", policy.vary_languages);
+        policy.vary_device_class = vary.value("user-agent", policy.vary_device_class);
+    }
+
+    if (policy.upstream_encoding != "gzip" && policy.upstream_encoding != "identity") {
+        throw std::runtime_error("upstream-encoding must be \"gzip\" or \"identity\"!");
+    }
+
+    // e.g. "cache-key": {"sort-query": true, "decode-percent": true, "drop-params": ["utm_*", "fbclid"]}
+    if (value.contains("cache-key")) {
+        const auto& key = value["cache-key"];
+        policy.key_normalizer = ProxySpace::KeyNormalizer(
+            key.value("sort-query", false),
+            key.value("decode-percent", false),
+            key.value("drop-params", std::vector<std::string>{}),
+            key.value("allow-params", std::vector<std::string>{})
+        );
+    }
+
+    if (policy.heuristic_fraction < 0.0 || policy.heuristic_fraction > 1.0) {
+        throw std::runtime_error("heuristic-fraction must be between 0 and 1!");
+    }
+
+    if (policy.segment_size == 0) {
+        throw std::runtime_error("segment-size must be greater than 0!");
+    }
+
+    return policy;
+}
+
+// Origins are HTTPS by default, so "https://" is dropped. An explicit "http://" is kept and
+// selects plain HTTP, e.g. for a local stub origin.
+static std::string NormalizeOrigin(std::string origin) {
+    if (origin.rfind("https://", 0) == 0) {
+        origin = origin.substr(8);
+    }
+
+    return origin;
+}
+
 int main()
 {
     std::ifstream config_file("cache_config.json");
@@ -13,7 +78,9 @@ int main()
 
     using json = nlohmann::json;
     json results = json::parse(config_file);
-    std::vector<std::thread> threads;
+    std::vector<ProxySpace::ProxyConfig> configs;
+    size_t worker_threads = 0; // 0 picks the runtime's default
+    size_t event_loops = 0; // 0 is one per core
 
     for (const auto& [key, value] : results.items()) {        
         if (!value.contains("port") || !value.contains("origin-url") || !value.contains("cache-size") || !value.contains("ttl")) {
@@ -22,19 +89,82 @@ int main()
 
         ProxySpace::ProxyConfig config;
 
-        // Make sure that the origin_url does not have "https://" in front. 
-        std::string origin_url = value["origin-url"];
-
-        if (origin_url.rfind("https://", 0) == 0) {
-            origin_url = origin_url.substr(8);
-        } else if (origin_url.rfind("http://", 0) == 0) {
-            origin_url = origin_url.substr(7);
-        }
+        std::string origin_url = NormalizeOrigin(value["origin-url"]);
 
         config.port = value["port"];
         config.origin_url = origin_url;
         config.cache_size = value["cache-size"];
-        config.ttl = value["ttl"];
+        config.policy = ParsePolicy(value, config.policy);
+        config.decompressed_cache_size = value.value("decompressed-cache-size", config.decompressed_cache_size);
+        config.early_refresh_beta = value.value("early-refresh-beta", 0.0);
+
+        // e.g. "access-log": {"path": "access.jsonl", "max-size": 104857600, "max-files": 5}
+        if (value.contains("access-log")) {
+            const auto& access_log = value["access-log"];
+            config.access_log_path = access_log.value("path", config.access_log_path);
+            config.access_log_max_size = access_log.value("max-size", config.access_log_max_size);
+            config.access_log_max_files = access_log.value("max-files", config.access_log_max_files);
+        }
+
+        // e.g. "auto-tune": {"min-size": 50, "max-size": 5000, "max-bytes": 536870912, "interval": 60}
+        if (value.contains("auto-tune")) {
+            const auto& tuning = value["auto-tune"];
+            auto& capacity_tuning = config.capacity_tuning;
+            capacity_tuning.min_size = tuning.value("min-size", config.cache_size);
+            capacity_tuning.max_size = tuning.value("max-size", config.cache_size * 4);
+            capacity_tuning.max_bytes = tuning.value("max-bytes", capacity_tuning.max_bytes);
+            capacity_tuning.min_gain = tuning.value("min-gain", capacity_tuning.min_gain);
+
+            if (tuning.contains("interval")) {
+                capacity_tuning.interval_ms = std::llround(tuning["interval"].get<double>() * 1000.0);
+            }
+
+            if (capacity_tuning.min_size < 1 || capacity_tuning.min_size > config.cache_size || capacity_tuning.max_size < config.cache_size) {
+                throw std::runtime_error("auto-tune needs 1 <= min-size <= cache-size <= max-size!");
+            }
+        }
+
+        // Proxies share the process's worker threads in proportion to their weights.
+        config.weight = value.value("weight", config.weight);
+        config.max_queued_connections = value.value("max-queued-connections", config.max_queued_connections);
+
+        if (config.weight < 1) {
+            throw std::runtime_error("weight must be at least 1!");
+        }
+
+        // "epoll" keeps idle keep-alive clients off the workers; see EventServer.
+        config.front_end = value.value("front-end", config.front_end);
+
+        if (config.front_end != "httplib" && config.front_end != "epoll") {
+            throw std::runtime_error("front-end must be \"httplib\" or \"epoll\"!");
+        }
+
+#ifndef __linux__
+        if (config.front_end == "epoll") {
+            throw std::runtime_error("front-end \"epoll\" is only available on Linux!");
+        }
+#endif
+
+        // The event loops are shared by all proxies, so the last "event-loops" configured wins.
+        if (value.contains("event-loops")) {
+            event_loops = value["event-loops"];
+        }
+
+        // The workers are shared by all proxies, so the last "worker-threads" configured wins.
+        if (value.contains("worker-threads")) {
+            worker_threads = value["worker-threads"];
+        }
+
+        // The logger is shared by all proxies, so the last "log-level" configured wins.
+        if (value.contains("log-level")) {
+            auto level = ProxySpace::Logger::ParseLevel(value["log-level"].get<std::string>());
+
+            if (!level) {
+                throw std::runtime_error("log-level must be one of debug, info, warn, error or off!");
+            }
+
+            ProxySpace::Logger::SetLevel(*level);
+        }
 
         // Add the routes
         if (value.contains("routes")) {
@@ -45,19 +175,31 @@ int main()
 
                 ProxySpace::RouteConfig route_config;
                 route_config.prefix = route["prefix"];
-                route_config.origin = route["origin"];
+                route_config.origin = NormalizeOrigin(route["origin"]);
+                route_config.policy = ParsePolicy(route, config.policy);
                 config.routes.push_back(route_config);
             }
         }
 
         std::cout << "Creating proxy with port: " << config.port << ", origin url: " << config.origin_url 
-            << ", cache size: " << config.cache_size << ", ttl: " << config.ttl << "\n";
+            << ", cache size: " << config.cache_size << ", ttl: " << config.policy.ttl_ms << "ms\n";
         std::cout << "Routes:\n";
 
         for (const auto& route : config.routes) {
             std::cout << "Route prefix: " << route.prefix << ", origin: " << route.origin << "\n";
         }
 
+        configs.push_back(config);
+    }
+
+    // Every proxy has to be configured before the first one starts the runtime.
+    ProxySpace::Runtime::Configure(worker_threads);
+#ifdef __linux__
+    ProxySpace::EventServer::Configure(event_loops);
+#endif
+    std::vector<std::thread> threads;
+
+    for (const auto& config : configs) {
         threads.emplace_back([config]() {
             ProxySpace::Proxy proxy{config};
             proxy.StartServer();
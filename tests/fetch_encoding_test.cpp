@@ -0,0 +1,105 @@
+// Responses the proxy does not store are passed on as the origin sent them, and the proxy asks
+// origins for gzip. Clients that did not ask for gzip must still get identity bodies.
+//
+// Runs a gzip-only origin in process and sends requests through Proxy::HandleRequest.
+
+#include "Compression.hpp"
+#include "Proxy.hpp"
+#include <iostream>
+#include <string>
+#include <thread>
+
+namespace {
+    int failures = 0;
+
+    void Check(bool condition, const std::string& what) {
+        if (!condition) {
+            std::cerr << "FAILED: " << what << "\n";
+            failures++;
+        }
+    }
+
+    const std::string BODY(4096, 'x');
+
+    httplib::Response Get(ProxySpace::Proxy& proxy, const std::string& target, const std::string& accept_encoding) {
+        httplib::Request req;
+        req.method = "GET";
+        req.target = target;
+        req.path = target;
+
+        if (!accept_encoding.empty()) {
+            req.headers.insert({"Accept-Encoding", accept_encoding});
+        }
+
+        httplib::Response res;
+        proxy.HandleRequest(req, res);
+
+        return res;
+    }
+
+    // The body a client reads, whether it came from the cached buffer or a content provider.
+    std::string Body(const httplib::Response& res) {
+        if (!res.content_provider_) {
+            return res.body;
+        }
+
+        std::string body;
+        httplib::DataSink sink;
+        sink.write = [&](const char* data, size_t length) { body.append(data, length); return true; };
+        sink.done = [] {};
+        res.content_provider_(0, res.content_length_, sink);
+
+        return body;
+    }
+}
+
+int main() {
+    httplib::Server origin;
+
+    // Gzip no matter what was asked for, as the proxy always asks for it.
+    auto gzipped = [](httplib::Response& res, int status, const std::string& cache_control) {
+        res.status = status;
+        res.set_content(*CacheSpace::GzipCompress(BODY), "text/plain");
+        res.set_header("Content-Encoding", "gzip");
+
+        if (!cache_control.empty()) {
+            res.set_header("Cache-Control", cache_control);
+        }
+    };
+
+    origin.Get("/no-store", [&](const httplib::Request&, httplib::Response& res) { gzipped(res, 200, "no-store"); });
+    origin.Get("/private", [&](const httplib::Request&, httplib::Response& res) { gzipped(res, 200, "private, max-age=60"); });
+    origin.Get("/error", [&](const httplib::Request&, httplib::Response& res) { gzipped(res, 503, ""); }); // not stored without freshness
+    origin.Get("/stored", [&](const httplib::Request&, httplib::Response& res) { gzipped(res, 200, "max-age=60"); });
+
+    int origin_port = origin.bind_to_any_port("localhost");
+    std::thread origin_thread([&] { origin.listen_after_bind(); });
+    origin.wait_until_ready();
+
+    {
+        ProxySpace::ProxyConfig config;
+        config.port = 0; // never listens; requests go straight to HandleRequest
+        config.origin_url = "http://localhost:" + std::to_string(origin_port);
+        config.cache_size = 16;
+        ProxySpace::Proxy proxy{config};
+
+        for (const std::string target : {"/no-store", "/private", "/error", "/stored"}) {
+            httplib::Response identity = Get(proxy, target, "");
+            Check(!identity.has_header("Content-Encoding"), target + " without Accept-Encoding is not encoded");
+            Check(Body(identity) == BODY, target + " without Accept-Encoding is the identity body");
+
+            httplib::Response gzip = Get(proxy, target, "gzip");
+            Check(gzip.get_header_value("Content-Encoding") == "gzip", target + " with Accept-Encoding: gzip is gzipped");
+            Check(CacheSpace::GzipDecompress(Body(gzip), BODY.size()) == BODY, target + " gzip body decodes to the identity body");
+        }
+    }
+
+    origin.stop();
+    origin_thread.join();
+
+    if (failures == 0) {
+        std::cout << "fetch_encoding_test: all checks passed\n";
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,388 @@
+// Replays access logs through CacheSpace::Cache in virtual time, to pick cache-size and ttl
+// from data. Every combination of capacity, TTL and maximum object size is simulated over
+// the whole trace, in parallel, and the miss ratio and byte miss ratio are printed per
+// capacity, one curve per (ttl, max object size) policy.
+//
+//   cache_sim --capacities 1000,10000,100000 --ttls 5,60,600 access.jsonl access.jsonl.1
+//
+// The trace is the proxy's access log ("access-log" in the config). Requests are keyed by
+// key_hash and sized by bytes; the log does not record Cache-Control, so every cacheable
+// response lives for the simulated TTL. Eviction is the cache's own LRU and expiry code.
+
+#include "Cache.hpp"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+    struct TraceRecord {
+        int64_t timestamp_ms;
+        uint64_t key;
+        uint32_t bytes;
+        uint16_t status;
+    };
+
+    struct Policy {
+        int64_t ttl_ms;
+        size_t max_object_size; // 0 admits every size
+    };
+
+    struct Config {
+        int capacity;
+        Policy policy;
+    };
+
+    struct Result {
+        uint64_t requests{0};
+        uint64_t misses{0};
+        uint64_t bytes{0};
+        uint64_t miss_bytes{0};
+        double seconds{0.0};
+    };
+
+    struct Options {
+        std::vector<std::string> traces;
+        std::vector<int> capacities; // empty sweeps powers of two up to the unique keys
+        std::vector<int64_t> ttls_ms{4000};
+        std::vector<size_t> max_object_sizes{0};
+        int port{0}; // 0 replays every port
+        size_t warmup{0}; // leading records that fill the cache without being counted
+        int threads{static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u))};
+        bool json{false};
+    };
+
+    // Pulls a numeric field out of one of our own log lines without parsing the whole object.
+    template <typename T>
+    bool ReadField(std::string_view line, std::string_view name, T& value, int base = 10) {
+        size_t pos = line.find(name);
+
+        if (pos == std::string_view::npos) {
+            return false;
+        }
+
+        const char* start = line.data() + pos + name.size();
+        const char* end = line.data() + line.size();
+
+        if (start < end && *start == '"') {
+            start++;
+        }
+
+        return std::from_chars(start, end, value, base).ec == std::errc{};
+    }
+
+    // Reads in large blocks and splits lines by hand; getline would be the bottleneck.
+    void LoadTrace(const std::string& path, int port, std::vector<TraceRecord>& records) {
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+
+        if (!file) {
+            throw std::runtime_error("Could not open trace " + path + "!");
+        }
+
+        constexpr size_t BLOCK = 16 * 1024 * 1024;
+        std::string buffer;
+        size_t carried = 0;
+
+        while (true) {
+            buffer.resize(carried + BLOCK);
+            size_t read = std::fread(buffer.data() + carried, 1, BLOCK, file);
+            size_t end = carried + read;
+            size_t start = 0;
+
+            // A last line without a newline still counts.
+            if (read == 0) {
+                if (carried == 0) {
+                    break;
+                }
+
+                buffer[end++] = '\n';
+            }
+
+            for (const char* newline; (newline = static_cast<const char*>(std::memchr(buffer.data() + start, '\n', end - start)));) {
+                std::string_view line(buffer.data() + start, newline - (buffer.data() + start));
+                start = newline - buffer.data() + 1;
+
+                TraceRecord record{};
+                int record_port = 0;
+                uint64_t bytes = 0;
+
+                if (!ReadField(line, "\"timestamp_ms\":", record.timestamp_ms) || !ReadField(line, "\"key_hash\":", record.key, 16)) {
+                    continue;
+                }
+
+                ReadField(line, "\"bytes\":", bytes);
+                ReadField(line, "\"status\":", record.status);
+
+                if (port != 0 && ReadField(line, "\"port\":", record_port) && record_port != port) {
+                    continue;
+                }
+
+                record.bytes = static_cast<uint32_t>(std::min<uint64_t>(bytes, UINT32_MAX));
+                records.push_back(record);
+            }
+
+            carried = end - start;
+            std::memmove(buffer.data(), buffer.data() + start, carried);
+        }
+
+        std::fclose(file);
+    }
+
+    // RFC 9111 section 4.2.2, the statuses the proxy may cache without explicit freshness.
+    bool IsCacheable(uint16_t status) {
+        switch (status) {
+            case 200: case 203: case 204: case 206: case 300: case 301: case 308:
+            case 404: case 405: case 410: case 414: case 501:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Each simulation runs on one thread, so the virtual time can be thread-local.
+    thread_local int64_t virtual_now_ms = 0;
+
+    int64_t VirtualNow() {
+        return virtual_now_ms;
+    }
+
+    Result Simulate(const std::vector<TraceRecord>& trace, const Config& config, size_t warmup) {
+        auto start = std::chrono::steady_clock::now();
+        CacheSpace::Cache cache(config.capacity, config.policy.ttl_ms, &VirtualNow);
+        Result result;
+        std::string key(sizeof(uint64_t), '\0'); // short enough to stay in the small-string buffer
+
+        for (size_t i = 0; i < trace.size(); i++) {
+            const TraceRecord& record = trace[i];
+            virtual_now_ms = record.timestamp_ms;
+
+            while (cache.CheckHeapTop()) {}
+
+            std::memcpy(key.data(), &record.key, sizeof(record.key));
+            auto cached = cache.get(key);
+            bool hit = cached && virtual_now_ms < cached->expires_at;
+
+            if (i >= warmup) {
+                result.requests++;
+                result.bytes += record.bytes;
+
+                if (!hit) {
+                    result.misses++;
+                    result.miss_bytes += record.bytes;
+                }
+            }
+
+            if (hit || !IsCacheable(record.status)) {
+                continue;
+            }
+
+            if (config.policy.max_object_size > 0 && record.bytes > config.policy.max_object_size) {
+                continue;
+            }
+
+            auto response = std::make_shared<CacheSpace::CachedResponse>();
+            response->status = record.status;
+            response->expires_at = virtual_now_ms + config.policy.ttl_ms;
+            cache.put(key, std::move(response));
+        }
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        return result;
+    }
+
+    template <typename T>
+    std::vector<T> ParseList(const std::string& value, double scale = 1.0) {
+        std::vector<T> items;
+        size_t start = 0;
+
+        while (start <= value.size()) {
+            size_t end = value.find(',', start);
+            items.push_back(static_cast<T>(std::llround(std::stod(value.substr(start, end - start)) * scale)));
+
+            if (end == std::string::npos) {
+                break;
+            }
+
+            start = end + 1;
+        }
+
+        return items;
+    }
+
+    Options ParseOptions(int argc, char** argv) {
+        Options options;
+
+        for (int i = 1; i < argc; i++) {
+            std::string name = argv[i];
+
+            if (name == "--json") {
+                options.json = true;
+                continue;
+            }
+
+            if (!name.starts_with("--")) {
+                options.traces.push_back(name);
+                continue;
+            }
+
+            if (i + 1 >= argc) {
+                throw std::runtime_error("Missing value for " + name + "!");
+            }
+
+            std::string value = argv[++i];
+
+            if (name == "--capacities") {
+                options.capacities = ParseList<int>(value);
+            } else if (name == "--ttls") {
+                options.ttls_ms = ParseList<int64_t>(value, 1000.0); // seconds, like "ttl" in the config
+            } else if (name == "--max-object-sizes") {
+                options.max_object_sizes = ParseList<size_t>(value);
+            } else if (name == "--port") {
+                options.port = std::stoi(value);
+            } else if (name == "--warmup") {
+                options.warmup = std::stoull(value);
+            } else if (name == "--threads") {
+                options.threads = std::max(std::stoi(value), 1);
+            } else {
+                throw std::runtime_error("Unknown option " + name + "!");
+            }
+        }
+
+        if (options.traces.empty()) {
+            throw std::runtime_error("usage: cache_sim [--capacities n,...] [--ttls s,...] [--max-object-sizes b,...] "
+                "[--port p] [--warmup records] [--threads n] [--json] access.jsonl...");
+        }
+
+        return options;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+
+    try {
+        options = ParseOptions(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+
+    auto load_start = std::chrono::steady_clock::now();
+    std::vector<TraceRecord> trace;
+
+    try {
+        for (const auto& path : options.traces) {
+            LoadTrace(path, options.port, trace);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    // Lines are written when requests finish, so arrival times are only nearly sorted.
+    std::stable_sort(trace.begin(), trace.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        return a.timestamp_ms < b.timestamp_ms;
+    });
+
+    double load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count();
+
+    if (options.capacities.empty()) {
+        std::unordered_set<uint64_t> unique;
+
+        for (const auto& record : trace) {
+            unique.insert(record.key);
+        }
+
+        for (size_t capacity = 64; capacity < unique.size() * 2; capacity *= 2) {
+            options.capacities.push_back(static_cast<int>(capacity));
+        }
+
+        if (options.capacities.empty()) {
+            options.capacities.push_back(64);
+        }
+    }
+
+    std::vector<Config> configs;
+
+    for (int64_t ttl_ms : options.ttls_ms) {
+        for (size_t max_object_size : options.max_object_sizes) {
+            for (int capacity : options.capacities) {
+                configs.push_back({capacity, {ttl_ms, max_object_size}});
+            }
+        }
+    }
+
+    std::vector<Result> results(configs.size());
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    auto sim_start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < std::min<int>(options.threads, static_cast<int>(configs.size())); i++) {
+        workers.emplace_back([&] {
+            for (size_t index; (index = next.fetch_add(1)) < configs.size();) {
+                results[index] = Simulate(trace, configs[index], options.warmup);
+            }
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    double sim_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - sim_start).count();
+    double simulated = static_cast<double>(trace.size()) * configs.size();
+
+    if (options.json) {
+        nlohmann::ordered_json j;
+        j["records"] = trace.size();
+        j["load_seconds"] = load_seconds;
+        j["records_per_second"] = sim_seconds > 0 ? simulated / sim_seconds : 0.0;
+        j["results"] = nlohmann::json::array();
+
+        for (size_t i = 0; i < configs.size(); i++) {
+            const Result& result = results[i];
+            nlohmann::ordered_json entry;
+            entry["capacity"] = configs[i].capacity;
+            entry["ttl_ms"] = configs[i].policy.ttl_ms;
+            entry["max_object_size"] = configs[i].policy.max_object_size;
+            entry["requests"] = result.requests;
+            entry["miss_ratio"] = result.requests ? static_cast<double>(result.misses) / result.requests : 0.0;
+            entry["byte_miss_ratio"] = result.bytes ? static_cast<double>(result.miss_bytes) / result.bytes : 0.0;
+            j["results"].push_back(entry);
+        }
+
+        std::cout << j.dump(4) << "\n";
+
+        return 0;
+    }
+
+    std::printf("%zu records loaded in %.2fs; %zu configurations simulated at %.2fM records/s\n",
+        trace.size(), load_seconds, configs.size(), sim_seconds > 0 ? simulated / sim_seconds / 1e6 : 0.0);
+
+    for (size_t i = 0; i < configs.size(); i++) {
+        const Config& config = configs[i];
+        const Result& result = results[i];
+
+        if (i == 0 || config.policy.ttl_ms != configs[i - 1].policy.ttl_ms || config.policy.max_object_size != configs[i - 1].policy.max_object_size) {
+            std::printf("\nttl %.3gs, max object size %s\n%12s %12s %12s\n", config.policy.ttl_ms / 1000.0,
+                config.policy.max_object_size ? std::to_string(config.policy.max_object_size).c_str() : "unlimited",
+                "capacity", "miss ratio", "byte miss");
+        }
+
+        std::printf("%12d %12.4f %12.4f\n", config.capacity,
+            result.requests ? static_cast<double>(result.misses) / result.requests : 0.0,
+            result.bytes ? static_cast<double>(result.miss_bytes) / result.bytes : 0.0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,401 @@
+// A synthetic origin for benchmarking the proxy and proxy_bench on one machine. Everything it
+// serves is described by a scenario file (see tools/origin_scenario.json):
+//
+//   stub_origin [scenario.json]
+//
+// Each route answers every path under its prefix with a generated body. A route sets the body
+// size, an injected latency distribution, the caching headers (Cache-Control, ETag,
+// Last-Modified, Vary), whether conditional requests get a 304, and how often requests fail.
+// Point the proxy at it with "origin-url": "http://localhost:<port>".
+
+#include "httplib.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    enum class LatencyDistribution { Fixed, Uniform, Normal, LogNormal, Exponential };
+
+    struct Latency {
+        LatencyDistribution distribution{LatencyDistribution::Fixed};
+        double mean_ms{0.0};
+        double stddev_ms{0.0}; // normal and lognormal
+        double min_ms{0.0}; // uniform lower bound, and a floor for the others
+        double max_ms{0.0}; // uniform upper bound, and a cap for the others; 0 is uncapped
+    };
+
+    struct SizeWeight {
+        size_t size;
+        double weight;
+    };
+
+    struct StubRoute {
+        std::string prefix;
+        std::vector<SizeWeight> sizes{{1024, 1.0}}; // picked by a hash of the path
+        bool size_param{true}; // ?size= overrides the sizes
+        Latency latency;
+        std::string cache_control{"max-age=60"};
+        std::string vary;
+        std::string content_type{"application/octet-stream"};
+        bool etag{true};
+        bool last_modified{true};
+        bool conditional{true}; // answer matching If-None-Match / If-Modified-Since with 304
+        int64_t version_every_s{0}; // bodies (and validators) change this often, 0 never
+        double failure_rate{0.0};
+        int failure_status{503};
+    };
+
+    struct Scenario {
+        int port{9000};
+        int threads{64}; // injected latency holds a thread, so keep this above the concurrency
+        size_t max_size{64 * 1024 * 1024};
+        std::vector<StubRoute> routes;
+    };
+
+    // What was served, for checking how much traffic the proxy absorbed.
+    struct Stats {
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> full{0};
+        std::atomic<uint64_t> not_modified{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> bytes{0};
+    };
+
+    uint64_t Fnv1a(std::string_view text, uint64_t hash = 0xcbf29ce484222325ULL) {
+        for (unsigned char c : text) {
+            hash = (hash ^ c) * 0x100000001b3ULL;
+        }
+
+        return hash;
+    }
+
+    std::string FormatHttpDate(int64_t seconds) {
+        std::time_t time = static_cast<std::time_t>(seconds);
+        std::tm tm{};
+        gmtime_r(&time, &tm);
+        char buffer[64];
+        std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return buffer;
+    }
+
+    Latency ParseLatency(const nlohmann::json& value) {
+        Latency latency;
+        std::string distribution = value.value("distribution", std::string("fixed"));
+
+        if (distribution == "fixed") {
+            latency.distribution = LatencyDistribution::Fixed;
+        } else if (distribution == "uniform") {
+            latency.distribution = LatencyDistribution::Uniform;
+        } else if (distribution == "normal") {
+            latency.distribution = LatencyDistribution::Normal;
+        } else if (distribution == "lognormal") {
+            latency.distribution = LatencyDistribution::LogNormal;
+        } else if (distribution == "exponential") {
+            latency.distribution = LatencyDistribution::Exponential;
+        } else {
+            throw std::runtime_error("latency distribution must be fixed, uniform, normal, lognormal or exponential!");
+        }
+
+        latency.mean_ms = value.value("mean-ms", latency.mean_ms);
+        latency.stddev_ms = value.value("stddev-ms", latency.stddev_ms);
+        latency.min_ms = value.value("min-ms", latency.min_ms);
+        latency.max_ms = value.value("max-ms", latency.max_ms);
+
+        return latency;
+    }
+
+    Scenario ParseScenario(const nlohmann::json& value) {
+        Scenario scenario;
+        scenario.port = value.value("port", scenario.port);
+        scenario.threads = value.value("threads", scenario.threads);
+        scenario.max_size = value.value("max-size", scenario.max_size);
+
+        for (const auto& item : value.value("routes", nlohmann::json::array())) {
+            StubRoute route;
+            route.prefix = item.value("prefix", std::string("/"));
+
+            // e.g. "sizes": [{"size": 1024, "weight": 0.9}, {"size": 1048576, "weight": 0.1}]
+            if (item.contains("size")) {
+                route.sizes = {{item["size"].get<size_t>(), 1.0}};
+            } else if (item.contains("sizes")) {
+                route.sizes.clear();
+
+                for (const auto& size : item["sizes"]) {
+                    route.sizes.push_back({size.at("size").get<size_t>(), size.value("weight", 1.0)});
+                }
+            }
+
+            if (item.contains("latency")) {
+                route.latency = ParseLatency(item["latency"]);
+            }
+
+            route.size_param = item.value("size-param", route.size_param);
+            route.cache_control = item.value("cache-control", route.cache_control);
+            route.vary = item.value("vary", route.vary);
+            route.content_type = item.value("content-type", route.content_type);
+            route.etag = item.value("etag", route.etag);
+            route.last_modified = item.value("last-modified", route.last_modified);
+            route.conditional = item.value("conditional", route.conditional);
+            route.version_every_s = item.value("version-every", route.version_every_s);
+            route.failure_rate = item.value("failure-rate", route.failure_rate);
+            route.failure_status = item.value("failure-status", route.failure_status);
+
+            if (route.sizes.empty()) {
+                throw std::runtime_error("Route " + route.prefix + " has no sizes!");
+            }
+
+            scenario.routes.push_back(std::move(route));
+        }
+
+        if (scenario.routes.empty()) {
+            scenario.routes.emplace_back();
+        }
+
+        return scenario;
+    }
+
+    class StubOrigin {
+    public:
+        explicit StubOrigin(Scenario scenario) : scenario(std::move(scenario)) {
+            // Bodies are slices of one pattern, so serving them allocates no more than a copy.
+            pattern.resize(this->scenario.max_size);
+
+            for (size_t i = 0; i < pattern.size(); i++) {
+                pattern[i] = 'a' + (i * 7 + i / 1024) % 26;
+            }
+
+            started_s = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        void Run() {
+            svr.new_task_queue = [this] { return new httplib::ThreadPool(scenario.threads); };
+            svr.set_tcp_nodelay(true);
+
+            svr.Get("/__stats", [this](const httplib::Request&, httplib::Response& res) {
+                nlohmann::ordered_json j;
+                j["requests"] = stats.requests.load();
+                j["full"] = stats.full.load();
+                j["not_modified"] = stats.not_modified.load();
+                j["failed"] = stats.failed.load();
+                j["bytes"] = stats.bytes.load();
+                res.set_content(j.dump(4), "application/json");
+            });
+
+            svr.Get("/.*", [this](const httplib::Request& req, httplib::Response& res) {
+                Serve(req, res);
+            });
+
+            std::cout << "Stub origin listening on port " << scenario.port << " with " << scenario.routes.size() << " routes\n";
+
+            if (!svr.listen("localhost", scenario.port)) {
+                std::cerr << "ERROR: Failed to bind to port " << scenario.port << ".\n";
+            }
+        }
+
+    private:
+        // The first route whose prefix matches, in scenario order.
+        const StubRoute* Match(const std::string& path) const {
+            for (const auto& route : scenario.routes) {
+                if (path.starts_with(route.prefix)) {
+                    return &route;
+                }
+            }
+
+            return nullptr;
+        }
+
+        void Serve(const httplib::Request& req, httplib::Response& res) {
+            stats.requests.fetch_add(1, std::memory_order_relaxed);
+            const StubRoute* route = Match(req.path);
+
+            if (!route) {
+                res.status = 404;
+                return;
+            }
+
+            thread_local std::mt19937_64 rng(std::random_device{}());
+            Sleep(route->latency, rng);
+
+            if (route->failure_rate > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(rng) < route->failure_rate) {
+                stats.failed.fetch_add(1, std::memory_order_relaxed);
+                res.status = route->failure_status;
+                res.set_content("injected failure\n", "text/plain");
+                return;
+            }
+
+            int64_t now_s = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            int64_t version = route->version_every_s > 0 ? (now_s - started_s) / route->version_every_s : 0;
+            int64_t modified_s = started_s + version * route->version_every_s;
+
+            // The body depends on the path, the version and the values of the Vary headers.
+            uint64_t hash = Fnv1a(req.path);
+            hash = Fnv1a(std::to_string(version), hash);
+
+            if (!route->vary.empty()) {
+                for (const auto& name : Split(route->vary)) {
+                    hash = Fnv1a(req.get_header_value(name), hash);
+                }
+            }
+
+            size_t size = SizeFor(*route, req, Fnv1a(req.path));
+            char etag[24];
+            std::snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(hash));
+
+            if (!route->cache_control.empty()) {
+                res.set_header("Cache-Control", route->cache_control);
+            }
+
+            if (!route->vary.empty()) {
+                res.set_header("Vary", route->vary);
+            }
+
+            if (route->etag) {
+                res.set_header("ETag", etag);
+            }
+
+            if (route->last_modified) {
+                res.set_header("Last-Modified", FormatHttpDate(modified_s));
+            }
+
+            res.set_header("Date", FormatHttpDate(now_s));
+            res.set_header("Accept-Ranges", "bytes"); // httplib answers Range requests for the body set below
+
+            if (route->conditional && NotModified(*route, req, etag, modified_s)) {
+                stats.not_modified.fetch_add(1, std::memory_order_relaxed);
+                res.status = 304;
+                return;
+            }
+
+            stats.full.fetch_add(1, std::memory_order_relaxed);
+            stats.bytes.fetch_add(size, std::memory_order_relaxed);
+            size_t offset = hash % 26; // differs per version, so changed bodies really differ
+            res.set_content(pattern.data() + std::min(offset, pattern.size() - size), size, route->content_type);
+        }
+
+        size_t SizeFor(const StubRoute& route, const httplib::Request& req, uint64_t hash) const {
+            if (route.size_param && req.has_param("size")) {
+                return std::min<size_t>(std::stoull(req.get_param_value("size")), scenario.max_size);
+            }
+
+            double total = 0.0;
+
+            for (const auto& size : route.sizes) {
+                total += size.weight;
+            }
+
+            double point = static_cast<double>(hash >> 11) / static_cast<double>(uint64_t{1} << 53) * total;
+
+            for (const auto& size : route.sizes) {
+                if (point < size.weight) {
+                    return std::min(size.size, scenario.max_size);
+                }
+
+                point -= size.weight;
+            }
+
+            return std::min(route.sizes.back().size, scenario.max_size);
+        }
+
+        bool NotModified(const StubRoute& route, const httplib::Request& req, const std::string& etag, int64_t modified_s) const {
+            if (route.etag && req.has_header("If-None-Match")) {
+                std::string tags = req.get_header_value("If-None-Match");
+                return tags == "*" || tags.find(etag) != std::string::npos;
+            }
+
+            if (route.last_modified && req.has_header("If-Modified-Since")) {
+                return req.get_header_value("If-Modified-Since") == FormatHttpDate(modified_s);
+            }
+
+            return false;
+        }
+
+        static void Sleep(const Latency& latency, std::mt19937_64& rng) {
+            double ms = latency.mean_ms;
+
+            switch (latency.distribution) {
+                case LatencyDistribution::Fixed:
+                    break;
+                case LatencyDistribution::Uniform:
+                    ms = std::uniform_real_distribution<double>(latency.min_ms, latency.max_ms)(rng);
+                    break;
+                case LatencyDistribution::Normal:
+                    ms = std::normal_distribution<double>(latency.mean_ms, latency.stddev_ms)(rng);
+                    break;
+                case LatencyDistribution::LogNormal: {
+                    // Parameterized by the mean and standard deviation of the latency itself.
+                    double variance = latency.stddev_ms * latency.stddev_ms;
+                    double mean = std::max(latency.mean_ms, 1e-9);
+                    double sigma2 = std::log1p(variance / (mean * mean));
+                    ms = std::lognormal_distribution<double>(std::log(mean) - sigma2 / 2, std::sqrt(sigma2))(rng);
+                    break;
+                }
+                case LatencyDistribution::Exponential:
+                    ms = latency.mean_ms > 0.0 ? std::exponential_distribution<double>(1.0 / latency.mean_ms)(rng) : 0.0;
+                    break;
+            }
+
+            ms = std::max(ms, latency.min_ms);
+
+            if (latency.max_ms > 0.0) {
+                ms = std::min(ms, latency.max_ms);
+            }
+
+            if (ms > 0.0) {
+                std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(ms));
+            }
+        }
+
+        static std::vector<std::string> Split(const std::string& list) {
+            std::vector<std::string> names;
+            size_t start = 0;
+
+            while (start < list.size()) {
+                size_t end = list.find(',', start);
+                std::string name = list.substr(start, end == std::string::npos ? std::string::npos : end - start);
+                size_t first = name.find_first_not_of(' ');
+                size_t last = name.find_last_not_of(' ');
+
+                if (first != std::string::npos) {
+                    names.push_back(name.substr(first, last - first + 1));
+                }
+
+                if (end == std::string::npos) {
+                    break;
+                }
+
+                start = end + 1;
+            }
+
+            return names;
+        }
+
+        Scenario scenario;
+        std::string pattern;
+        int64_t started_s;
+        Stats stats;
+        httplib::Server svr;
+    };
+}
+
+int main(int argc, char** argv) {
+    std::string path = argc > 1 ? argv[1] : "origin_scenario.json";
+    std::ifstream scenario_file(path);
+
+    if (!scenario_file.is_open()) {
+        std::cerr << "Could not open scenario file " << path << "!\n";
+        return 2;
+    }
+
+    StubOrigin origin(ParseScenario(nlohmann::json::parse(scenario_file)));
+    origin.Run();
+}